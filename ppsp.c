@@ -36,8 +36,19 @@ static char *id = SNDRV_DEFAULT_STR1;	/* ID for this card */
 static bool enable = SNDRV_DEFAULT_ENABLE1;	/* Enable this card */
 static bool nopcm;	/* Disable PCM capability of the driver */
 static int pp_port = 0x378;
+static int pp_port2 = 0;
+#if PPSP_GPIO
+char *gpio_chip;
+int gpio_offset = 0;
+#endif
 int hr_thr = 24000;
+bool hr_thr_user;	/* set explicitly, calibration keeps it */
 int allow_vol_boost = 0;
+int calibrate = 0;
+int noise_shape = PPSP_NSHAPE_1ST;
+int spin_ns = 0;
+int timer_div = 48;
+int qos_us = 20;
 
 #if PPSP_DEBUG
 static int debug = PPSP_DEBUG;
@@ -47,18 +58,90 @@ static int debug = PPSP_DEBUG;
 module_param(debug, int, 0444);
 MODULE_PARM_DESC(debug, "Debugging messages.");
 #endif
+/*
+ * hr_thr and allow_vol_boost can be changed through
+ * /sys/module/snd_ppsp/parameters; both are picked up by the next
+ * prepare, the stream that plays keeps its settings. The ports are
+ * load-time only, writing them at runtime would point outb() anywhere.
+ */
+static int ppsp_set_hr_thr(const char *val, const struct kernel_param *kp)
+{
+	int thr, err;
+
+	err = kstrtoint(val, 0, &thr);
+	if (err)
+		return err;
+	/* the max rate turns half-rate off */
+	if (thr < 0 || thr > PPSP_MAX_RATE__1)
+		return -EINVAL;
+	hr_thr = thr;
+	hr_thr_user = true;
+	return 0;
+}
+
+static const struct kernel_param_ops ppsp_hr_thr_ops = {
+	.set = ppsp_set_hr_thr,
+	.get = param_get_int,
+};
+
+static int ppsp_set_vol_boost(const char *val, const struct kernel_param *kp)
+{
+	bool boost;
+	int err;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,6,0)
+	err = strtobool(val, &boost);
+#else
+	err = kstrtobool(val, &boost);
+#endif
+	if (err)
+		return err;
+	/* the volume is clamped with the timer stopped, see ppsp_apply_params() */
+	allow_vol_boost = boost;
+	return 0;
+}
+
+static const struct kernel_param_ops ppsp_vol_boost_ops = {
+	.set = ppsp_set_vol_boost,
+	.get = param_get_int,
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0)
 module_param(pp_port, int, 0444);
 MODULE_PARM_DESC(pp_port, "Port number of the parallel port. (default: 0x378)");
+module_param(pp_port2, int, 0444);
+#else
+module_param_hw(pp_port, int, ioport, 0444);
+MODULE_PARM_DESC(pp_port, "Port number of the parallel port. (default: 0x378)");
+module_param_hw(pp_port2, int, ioport, 0444);
+#endif
+MODULE_PARM_DESC(pp_port2, "Port of a second parallel port for the right channel, 0 downmixes to mono. (default: 0)");
+#if PPSP_GPIO
+module_param(gpio_chip, charp, 0444);
+MODULE_PARM_DESC(gpio_chip, "Label of the gpio chip with an R-2R DAC, instead of the parallel port.");
+module_param(gpio_offset, int, 0444);
+MODULE_PARM_DESC(gpio_offset, "First of the 8 DAC lines on gpio_chip, LSB first. (default: 0)");
+#endif
 //unused. module_param(pp_irq, int, 0444);
 //MODULE_PARM_DESC(pp_irq, "IRQ number of the parallel port. (default: 0x7)");
 module_param(index, int, 0444);
 MODULE_PARM_DESC(index, "Index value for ppsp soundcard.");
 module_param(id, charp, 0444);
 MODULE_PARM_DESC(id, "ID string for ppsp soundcard.");
-module_param(hr_thr, int, 0444);
+module_param_cb(hr_thr, &ppsp_hr_thr_ops, &hr_thr, 0644);
 MODULE_PARM_DESC(hr_thr, "Enable half-rate mode above this freq, for slow machines. (default: 24000)");
-module_param(allow_vol_boost, int, 0444);
+module_param_cb(allow_vol_boost, &ppsp_vol_boost_ops, &allow_vol_boost, 0644);
 MODULE_PARM_DESC(allow_vol_boost, "Allow volume over 100%. (default: 0)");
+module_param(noise_shape, int, 0444);
+MODULE_PARM_DESC(noise_shape, "Noise shaping of 16->8 bit requantization, 0=off 1=1st order 2=2nd order. (default: 1)");
+module_param(spin_ns, int, 0444);
+MODULE_PARM_DESC(spin_ns, "Wake the timer up to this many ns early and spin to the exact deadline, 0 disables. (default: 0)");
+module_param(timer_div, int, 0444);
+MODULE_PARM_DESC(timer_div, "Frames per tick of the sample clock ALSA timer. (default: 48)");
+module_param(qos_us, int, 0444);
+MODULE_PARM_DESC(qos_us, "CPU latency limit in us while a stream plays, -1 disables. (default: 20)");
+module_param(calibrate, int, 0444);
+MODULE_PARM_DESC(calibrate, "Benchmark port and timer at load, set hr_thr and max rate from it. (default: 0)");
 #if 0
 module_param(enable, bool, 0444);
 MODULE_PARM_DESC(enable, "Enable PC-Speaker sound.");
@@ -109,16 +192,34 @@ static int snd_ppsp_create(struct snd_card *card)
 	atomic_set(&ppsp_chip.timer_active, 0);
 	ppsp_chip.enable = 1;
 	ppsp_chip.ppspkr = 0;
+	ppsp_chip.nshape = clamp(noise_shape, PPSP_NSHAPE_OFF, PPSP_NSHAPE_MAX);
 
 	spin_lock_init(&ppsp_chip.substream_lock);
+	spin_lock_init(&ppsp_chip.capture_lock);
+	atomic_set(&ppsp_chip.cap_active, 0);
 
 	ppsp_chip.card = card;
 	ppsp_chip.port = pp_port;
+	/* the gpio dac is mono, and the port is left alone */
+	ppsp_chip.port2 = ppsp_chip.dac_gpios ? 0 : pp_port2;
 	ppsp_chip.irq = -1;
 	ppsp_chip.dma = -1;
 
 	ppsp_chip.srate = PPSP_DEFAULT_SRATE;
 	ppsp_chip.half_rate = 0;
+	ppsp_chip.rate_max = PPSP_MAX_RATE__1;
+
+	if (!nopcm && calibrate)
+		ppsp_calibrate(&ppsp_chip);
+
+	ppsp_chip.stimer_div = max(timer_div, 1);
+	atomic_set(&ppsp_chip.stimer_on, 0);
+
+	ppsp_chip.spin_max = clamp(spin_ns, 0, (int)PPSP_MIN_PERIOD_NS / 2);
+	/* start from the measured jitter if we have it */
+	ppsp_chip.spin_jit = ppsp_chip.calib.done ?
+		ppsp_chip.calib.jitter_ns : ppsp_chip.spin_max / 2;
+	ppsp_chip.spin_margin = min(ppsp_chip.spin_jit, ppsp_chip.spin_max);
 
 	/* Register device */
 	err = snd_device_new(card, SNDRV_DEV_LOWLEVEL, &ppsp_chip, &ops);
@@ -139,10 +240,20 @@ static int snd_card_ppsp_probe(int devnum, struct device *dev)
 	hrtimer_init(&ppsp_chip.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	ppsp_chip.timer.function = ppsp_do_timer;
 
-	err = snd_card_new(dev, index, id, THIS_MODULE, 0, &card);
+	err = ppsp_gpio_init(&ppsp_chip, dev);
 	if (err < 0)
 		return err;
 
+	/* the pcm can be opened as soon as the card is registered */
+	err = ppsp_kpcm_init(&ppsp_chip);
+	if (err < 0)
+		goto free_gpio;
+	ppsp_qos_init(&ppsp_chip);
+
+	err = snd_card_new(dev, index, id, THIS_MODULE, 0, &card);
+	if (err < 0)
+		goto free_kpcm;
+
 	err = snd_ppsp_create(card);
 	if (err < 0)
 		goto free_card;
@@ -151,15 +262,29 @@ static int snd_card_ppsp_probe(int devnum, struct device *dev)
 		err = snd_ppsp_new_pcm(&ppsp_chip);
 		if (err < 0)
 			goto free_card;
+		err = snd_ppsp_new_timer(&ppsp_chip);
+		if (err < 0)
+			goto free_card;
 	}
 	err = snd_ppsp_new_mixer(&ppsp_chip, nopcm);
+	if (err < 0)
+		goto free_card;
+	err = snd_ppsp_new_proc(&ppsp_chip);
 	if (err < 0)
 		goto free_card;
 
 	strcpy(card->driver, "PP-Speaker");
 	strcpy(card->shortname, "ppsp");
-	sprintf(card->longname, "%s (%s) at port 0x%x",
-		card->driver, card->shortname, ppsp_chip.port);
+	if (ppsp_chip.dac_gpios)
+		sprintf(card->longname, "%s (%s) at GPIO DAC",
+			card->driver, card->shortname);
+	else if (ppsp_chip.port2)
+		sprintf(card->longname, "%s (%s) at ports 0x%x,0x%x",
+			card->driver, card->shortname,
+			ppsp_chip.port, ppsp_chip.port2);
+	else
+		sprintf(card->longname, "%s (%s) at port 0x%x",
+			card->driver, card->shortname, ppsp_chip.port);
 
 	err = snd_card_register(card);
 	if (err < 0)
@@ -169,6 +294,11 @@ static int snd_card_ppsp_probe(int devnum, struct device *dev)
 
 free_card:
 	snd_card_free(card);
+free_kpcm:
+	ppsp_kpcm_exit(&ppsp_chip);
+	ppsp_qos_exit(&ppsp_chip);
+free_gpio:
+	ppsp_gpio_exit(&ppsp_chip);
 	return err;
 }
 
@@ -201,7 +331,11 @@ static int alsa_card_ppsp_init(struct device *dev)
 
 static void alsa_card_ppsp_exit(struct snd_ppsp *chip)
 {
+	/* stops and syncs the pcm streams */
 	snd_card_free(chip->card);
+	/* then the kernel stream, nothing ticks past this */
+	ppsp_kpcm_exit(chip);
+	ppsp_gpio_exit(chip);
 }
 
 static int ppsp_probe(struct platform_device *dev)
@@ -219,6 +353,7 @@ static int ppsp_probe(struct platform_device *dev)
 	}
 
 	platform_set_drvdata(dev, &ppsp_chip);
+	ppsp_trace_init();
 	return 0;
 }
 
@@ -227,11 +362,15 @@ static int ppsp_remove(struct platform_device *dev)
 	struct snd_ppsp *chip = platform_get_drvdata(dev);
 	ppspkr_input_remove(chip->input_dev);
 	alsa_card_ppsp_exit(chip);
+	/* the tick emits into the relay, close it only once nothing ticks */
+	ppsp_trace_exit();
+	ppsp_qos_exit(chip);
 	return 0;
 }
 
 static void ppsp_stop_beep(struct snd_ppsp *chip)
 {
+	ppsp_kpcm_stop(chip);
 	ppsp_sync_stop(chip);
 	ppspkr_stop_sound();
 }
@@ -240,11 +379,23 @@ static void ppsp_stop_beep(struct snd_ppsp *chip)
 static int ppsp_suspend(struct device *dev)
 {
 	struct snd_ppsp *chip = dev_get_drvdata(dev);
+	snd_power_change_state(chip->card, SNDRV_CTL_POWER_D3hot);
+	/* newer cores already did it, then this is a no-op */
+	if (chip->pcm)
+		snd_pcm_suspend_all(chip->pcm);
 	ppsp_stop_beep(chip);
 	return 0;
 }
 
-static SIMPLE_DEV_PM_OPS(ppsp_pm, ppsp_suspend, NULL);
+static int ppsp_resume(struct device *dev)
+{
+	struct snd_ppsp *chip = dev_get_drvdata(dev);
+	ppsp_restore_port(chip);
+	snd_power_change_state(chip->card, SNDRV_CTL_POWER_D0);
+	return 0;
+}
+
+static SIMPLE_DEV_PM_OPS(ppsp_pm, ppsp_suspend, ppsp_resume);
 #define PPSP_PM_OPS	&ppsp_pm
 #else
 #define PPSP_PM_OPS	NULL
@@ -13,9 +13,18 @@
 
 #define PPSP_SOUND_VERSION 0x040	/* read 0.4.0 */
 #define PPSP_DEBUG 0
+#define PPSP_TRACE (IS_ENABLED(CONFIG_RELAY) && IS_ENABLED(CONFIG_DEBUG_FS))
+#define PPSP_GPIO (IS_ENABLED(CONFIG_GPIOLIB) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0))
 #define PPSP_I8253 0
 
 #include <linux/hrtimer.h>
+#include <linux/io.h>
+#include <linux/delay.h>
+#include <linux/pm_qos.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/version.h>
 #if PPSP_I8253
 #include <linux/i8253.h>
 #include <linux/timex.h>
@@ -47,59 +56,271 @@
 #define PPSP_RATE() PPSP_CALC_RATE(chip->srate)
 #define PPSP_MIN_RATE__1 8000
 #define PPSP_MAX_RATE__1 48000
-#define PPSP_MAX_PERIOD_NS (1000000000ULL * PPSP_MIN_RATE__1)
-#define PPSP_MIN_PERIOD_NS (1000000000ULL * PPSP_MAX_RATE__1)
-#define PPSP_CALC_NS() ({ \
-	u64 __val = 1000000000ULL; \
-	do_div(__val, (chip->srate >> chip->half_rate)); \
+#define PPSP_MAX_PERIOD_NS (1000000000ULL / PPSP_MIN_RATE__1)
+#define PPSP_MIN_PERIOD_NS (1000000000ULL / PPSP_MAX_RATE__1)
+/* tick length in whole ns, the remainder (in 1/srate ns units) goes to rem */
+#define PPSP_CALC_NS(rem) ({ \
+	u64 __val = 1000000000ULL << chip->half_rate; \
+	(rem) = do_div(__val, chip->srate); \
 	__val; \
 })
 
-#define PPSP_MAX_PERIOD_SIZE	(64*1024)
+/* vmalloc'ed at hw_params, nothing is held while the card is idle */
+#define PPSP_MAX_PERIOD_SIZE	(8*1024*1024)
 #define PPSP_MAX_PERIODS	512
-#define PPSP_BUFFER_SIZE	(128*1024)
+#define PPSP_BUFFER_SIZE	(16*1024*1024)
 
 #define PPSP_VOL2MOD() (15 - chip->volume)
 
+/* noise shaping filters of the 16->8 bit requantizer */
+#define PPSP_NSHAPE_OFF	0
+#define PPSP_NSHAPE_1ST	1
+#define PPSP_NSHAPE_2ND	2
+#define PPSP_NSHAPE_MAX	PPSP_NSHAPE_2ND
+
+struct device;
+struct gpio_descs;
+struct snd_timer;
+
+struct ppsp_adpcm {
+	int pred;
+	int index;
+};
+
+struct ppsp_calib {
+	int done;
+	u32 ticks;
+	u32 outb_ns;	/* one port write */
+	u32 cb_ns;	/* timer callback body */
+	u32 late_ns;	/* average wakeup lateness */
+	u32 jitter_ns;	/* 99th percentile lateness over the average */
+};
+
+/* in-kernel producer, see ppsp_kpcm.c */
+struct ppsp_kpcm {
+	DECLARE_KFIFO_PTR(fifo, s16);
+	spinlock_t lock;	/* the fifo and the fields below */
+	struct mutex mutex;	/* starting and stopping the timer */
+	atomic_t on;		/* the kernel stream drives the timer */
+	atomic_t drained;	/* the tick found the fifo empty */
+	int ready;
+	int held;		/* the pcm is open, it owns the timer */
+	size_t preempt_left;	/* samples at the head muting the pcm */
+	unsigned int rate;
+	u32 step;		/* source samples per tick, 16.16 */
+	u32 phase;
+};
+
 struct snd_ppsp {
 	struct snd_card *card;
 	struct snd_pcm *pcm;
 	struct input_dev *input_dev;
 	struct hrtimer timer;
 	unsigned short port, irq, dma;
+	unsigned short port2;	/* right channel port, 0 when downmixing */
+	struct gpio_descs *dac_gpios;	/* R-2R dac instead of the port */
+	u32 gpio_write_ns;
+	int gpio_sleeps;	/* written from a work, for testing */
 	spinlock_t substream_lock;
 	struct snd_pcm_substream *playback_substream;
+	/* loopback capture of the port values */
+	spinlock_t capture_lock;
+	struct snd_pcm_substream *capture_substream;
+	atomic_t cap_active;
+	unsigned int cap_chans;
+	size_t cap_ptr;
+	size_t cap_period_ptr;
+	size_t cap_period_bytes;
+	size_t cap_buffer_bytes;
 	unsigned int fmt_size;
+	unsigned int frame_bytes;
+	unsigned int frame_bits;
+	const s16 *xlat;	/* 8-bit format to s16, NULL for S16 */
+	int is_adpcm;
+	struct ppsp_adpcm adpcm[2];
+	size_t adpcm_next;	/* nibble the decoder state is at */
 	unsigned int is_signed;
 	unsigned int chans;
 	unsigned int srate;
 	unsigned int half_rate;
+	unsigned int rate_max;
 	size_t playback_ptr;
 	size_t period_ptr;
+	unsigned int tick_bits;
+	unsigned int bit_phase;	/* sub-byte position, 4-bit formats */
+	size_t period_bytes;
+	size_t buffer_bytes;
+	u64 frames_played;
+	u64 link_frames;	/* frame index of the last outb */
+	ktime_t link_time;	/* and its time */
+	ktime_t emit_time;
 	atomic_t timer_active;
 	int enable;
 	int toggle1;
 	int toggle2;
 	int ppspkr;
 	u64 NS;
+	u32 ns_rem;
+	u32 ns_acc;
 	int volume;
 	int volume_mod;
+	int nshape;
+	int ns_err[2][2];	/* per channel */
 	u8 last_val;
+	u8 last_val2;
+	/* alsa timer on the sample clock */
+	struct snd_timer *stimer;
+	atomic_t stimer_on;
+	unsigned int stimer_div;	/* frames per timer tick */
+	unsigned int stimer_frames;
+	/* early wakeup, then spin to the exact deadline */
+	u32 spin_max;		/* margin cap, 0 = off */
+	u32 spin_margin;	/* how early the timer is armed */
+	u32 spin_jit;		/* decaying peak of the lateness */
+	ktime_t deadline;
+	u64 spin_total_ns;
+	u64 spin_ticks;
+	u64 spin_late;		/* woke after the deadline, or ticks skipped */
+	struct ppsp_calib calib;
+	struct pm_qos_request qos;	/* cpu latency while streaming */
+	struct ppsp_kpcm kpcm;
 };
 
+/*
+ * Advance the hw pointer by inc bytes, wrapping at buffer_bytes, and
+ * return how many period boundaries were crossed; period_ptr is moved
+ * past them. No hw access, so it can be driven from a test harness.
+ */
+static inline unsigned int ppsp_ptr_advance(size_t *ptr, size_t *period_ptr,
+	size_t inc, size_t period_bytes, size_t buffer_bytes)
+{
+	size_t done;
+	unsigned int periods;
+
+	*ptr += inc;
+	if (*ptr >= buffer_bytes)
+		*ptr %= buffer_bytes;
+	if (*ptr >= *period_ptr)
+		done = *ptr - *period_ptr;
+	else
+		done = *ptr + buffer_bytes - *period_ptr;
+	/* the common case, spare the division */
+	if (done < period_bytes)
+		return 0;
+	periods = done / period_bytes;
+	*period_ptr += periods * period_bytes;
+	if (*period_ptr >= buffer_bytes)
+		*period_ptr %= buffer_bytes;
+	return periods;
+}
+
+#if PPSP_GPIO
+extern char *gpio_chip;
+extern int gpio_offset;
+extern void ppsp_gpio_write(struct snd_ppsp *chip, u8 val);
+extern int ppsp_gpio_init(struct snd_ppsp *chip, struct device *dev);
+extern void ppsp_gpio_exit(struct snd_ppsp *chip);
+#else
+static inline void ppsp_gpio_write(struct snd_ppsp *chip, u8 val) {}
+static inline int ppsp_gpio_init(struct snd_ppsp *chip, struct device *dev)
+{
+	return 0;
+}
+static inline void ppsp_gpio_exit(struct snd_ppsp *chip) {}
+#endif
+
+/* put a sample on the dac: the gpio one, or the port(s) */
+static inline void ppsp_out(struct snd_ppsp *chip, u8 val, u8 val2)
+{
+	if (chip->dac_gpios) {
+		ppsp_gpio_write(chip, val);
+		return;
+	}
+	outb(val, chip->port);
+	if (chip->port2)
+		outb(val2, chip->port2);
+}
+
+/* same, paced like outb_p, for the ramps */
+static inline void ppsp_out_p(struct snd_ppsp *chip, u8 val, u8 val2)
+{
+	if (chip->dac_gpios) {
+		ppsp_gpio_write(chip, val);
+		udelay(1);
+		return;
+	}
+	outb_p(val, chip->port);
+	if (chip->port2)
+		outb_p(val2, chip->port2);
+}
+
+/* one emitted tick, as recorded by the capture relay */
+struct ppsp_trace_rec {
+	u64 ts;		/* ktime of the outb, ns */
+	u32 pos;	/* playback_ptr the sample was read from */
+	u8 val;		/* port value */
+	u8 val2;	/* second port value */
+	u16 flags;
+} __packed;
+
+#define PPSP_TRACE_HALF_RATE	0x0001
+#define PPSP_TRACE_MUTED	0x0002
+
+#if PPSP_TRACE
+extern bool ppsp_trace_on;
+extern void ppsp_trace_emit(struct snd_ppsp *chip, u8 val, u8 val2);
+extern void ppsp_trace_init(void);
+extern void ppsp_trace_exit(void);
+#else
+#define ppsp_trace_on 0
+static inline void ppsp_trace_emit(struct snd_ppsp *chip, u8 val, u8 val2) {}
+static inline void ppsp_trace_init(void) {}
+static inline void ppsp_trace_exit(void) {}
+#endif
+
 #if PPSP_DEBUG
 extern int debug;
 #endif
 
 extern int hr_thr;
+extern bool hr_thr_user;
 extern int allow_vol_boost;
+extern int calibrate;
+extern int noise_shape;
+extern int spin_ns;
+extern int timer_div;
+extern int qos_us;
 
 extern struct snd_ppsp ppsp_chip;
 
 extern enum hrtimer_restart ppsp_do_timer(struct hrtimer *handle);
 extern void ppsp_sync_stop(struct snd_ppsp *chip);
+extern void ppsp_restore_port(struct snd_ppsp *chip);
+extern int ppsp_start_kernel(struct snd_ppsp *chip, unsigned int rate);
+extern int ppsp_kpcm_tick(struct snd_ppsp *chip, int *s, bool *preempt);
+extern bool ppsp_kpcm_drained(struct snd_ppsp *chip);
+extern void ppsp_kpcm_retime(struct snd_ppsp *chip);
+extern void ppsp_kpcm_yield(struct snd_ppsp *chip);
+extern void ppsp_kpcm_kick(struct snd_ppsp *chip);
+extern void ppsp_kpcm_stop(struct snd_ppsp *chip);
+extern int ppsp_kpcm_init(struct snd_ppsp *chip);
+extern void ppsp_kpcm_exit(struct snd_ppsp *chip);
+extern void ppsp_qos_init(struct snd_ppsp *chip);
+extern void ppsp_qos_exit(struct snd_ppsp *chip);
 
 extern int snd_ppsp_new_pcm(struct snd_ppsp *chip);
 extern int snd_ppsp_new_mixer(struct snd_ppsp *chip, int nopcm);
+extern int snd_ppsp_new_proc(struct snd_ppsp *chip);
+extern int snd_ppsp_new_timer(struct snd_ppsp *chip);
+extern const struct snd_pcm_ops snd_ppsp_capture_ops;
+extern void ppsp_capture_emit(struct snd_ppsp *chip, u8 val, u8 val2);
+extern void ppsp_timer_tick(struct snd_ppsp *chip, unsigned int frames);
+
+extern s16 ppsp_xlat_u8[256];
+extern s16 ppsp_xlat_ulaw[256];
+extern s16 ppsp_xlat_alaw[256];
+extern int ppsp_adpcm_decode(struct ppsp_adpcm *st, u8 code);
+extern void ppsp_codec_init(void);
+extern void ppsp_calibrate(struct snd_ppsp *chip);
 
 #endif
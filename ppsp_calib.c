@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * PP-Speaker driver for Linux
+ *
+ * Load-time calibration of the port and timer.
+ * Copyright (C) 2022-2022  ariel/KotCzarny
+ */
+
+#include <linux/hrtimer.h>
+#include <linux/completion.h>
+#include <linux/jiffies.h>
+#include <linux/io.h>
+#include <linux/math64.h>
+#include "ppsp.h"
+
+#define PPSP_CALIB_WRITES	256
+#define PPSP_CALIB_TICKS	(PPSP_MAX_RATE__1 / 10)	/* 100ms at max rate */
+/* let the tick eat at most 1/4 of the cpu */
+#define PPSP_CALIB_LOAD		4
+/* lateness histogram, the last bucket takes everything above */
+#define PPSP_CALIB_BUCKET_NS	256
+#define PPSP_CALIB_BUCKETS	128
+/* a rare SMI or irq burst must not cap the rate, only steady jitter */
+#define PPSP_CALIB_PCT		99
+
+static struct {
+	struct hrtimer timer;
+	struct completion done;
+	struct snd_ppsp *chip;
+	u8 val;
+	u32 ticks;
+	u64 late_sum;
+	u64 late_max;
+	u64 cb_sum;
+	u32 late_hist[PPSP_CALIB_BUCKETS];
+} ppsp_cal;
+
+static enum hrtimer_restart ppsp_calib_timer(struct hrtimer *handle)
+{
+	ktime_t now = ktime_get();
+	s64 late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(handle)));
+
+	if (late < 0)
+		late = 0;
+	ppsp_cal.late_sum += late;
+	if (late > ppsp_cal.late_max)
+		ppsp_cal.late_max = late;
+	ppsp_cal.late_hist[min_t(s64, late / PPSP_CALIB_BUCKET_NS,
+				 PPSP_CALIB_BUCKETS - 1)]++;
+
+	ppsp_out(ppsp_cal.chip, ppsp_cal.val, ppsp_cal.val);
+	ppsp_cal.cb_sum += ktime_to_ns(ktime_sub(ktime_get(), now));
+
+	if (++ppsp_cal.ticks >= PPSP_CALIB_TICKS) {
+		complete(&ppsp_cal.done);
+		return HRTIMER_NORESTART;
+	}
+	hrtimer_forward(handle, hrtimer_get_expires(handle),
+		ns_to_ktime(PPSP_MIN_PERIOD_NS));
+	return HRTIMER_RESTART;
+}
+
+/* lateness below which PPSP_CALIB_PCT percent of the ticks woke up */
+static u64 ppsp_calib_late_pct(void)
+{
+	u32 want = div_u64((u64)ppsp_cal.ticks * PPSP_CALIB_PCT, 100);
+	u32 seen = 0;
+	int i;
+
+	for (i = 0; i < PPSP_CALIB_BUCKETS - 1; i++) {
+		seen += ppsp_cal.late_hist[i];
+		if (seen >= want)
+			return (u64)(i + 1) * PPSP_CALIB_BUCKET_NS;
+	}
+	return ppsp_cal.late_max;
+}
+
+/*
+ * Measure the port (or gpio dac) write cost, the timer callback cost and the wakeup
+ * jitter, then derive hr_thr and the advertised max rate from them.
+ */
+void ppsp_calibrate(struct snd_ppsp *chip)
+{
+	struct ppsp_calib *cal = &chip->calib;
+	unsigned long flags;
+	ktime_t t0, t1;
+	u64 rate, late_pct;
+	int i;
+
+	memset(&ppsp_cal, 0, sizeof(ppsp_cal));
+	ppsp_cal.chip = chip;
+	/* rewrite whatever is latched, so nothing is heard */
+	ppsp_cal.val = chip->dac_gpios ? chip->last_val : inb(chip->port);
+
+	local_irq_save(flags);
+	t0 = ktime_get();
+	for (i = 0; i < PPSP_CALIB_WRITES; i++)
+		ppsp_out(chip, ppsp_cal.val, ppsp_cal.val);
+	t1 = ktime_get();
+	local_irq_restore(flags);
+	cal->outb_ns = div_u64(ktime_to_ns(ktime_sub(t1, t0)), PPSP_CALIB_WRITES);
+
+	init_completion(&ppsp_cal.done);
+	hrtimer_init(&ppsp_cal.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ppsp_cal.timer.function = ppsp_calib_timer;
+	hrtimer_start(&ppsp_cal.timer, ns_to_ktime(PPSP_MIN_PERIOD_NS),
+		HRTIMER_MODE_REL);
+	if (!wait_for_completion_timeout(&ppsp_cal.done, msecs_to_jiffies(1000)))
+		printk(KERN_WARNING "PPSP: calibration run timed out\n");
+	hrtimer_cancel(&ppsp_cal.timer);
+
+	if (!ppsp_cal.ticks) {
+		printk(KERN_WARNING "PPSP: calibration failed, keeping defaults\n");
+		return;
+	}
+	cal->ticks = ppsp_cal.ticks;
+	cal->cb_ns = div_u64(ppsp_cal.cb_sum, ppsp_cal.ticks);
+	cal->late_ns = div_u64(ppsp_cal.late_sum, ppsp_cal.ticks);
+	late_pct = ppsp_calib_late_pct();
+	cal->jitter_ns = late_pct > cal->late_ns ? late_pct - cal->late_ns : 0;
+
+	/*
+	 * full rate limit: by cpu load, and jitter must stay under half a tick;
+	 * waking up late is not cpu time, only the callback is
+	 */
+	rate = div64_u64(1000000000ULL,
+		max_t(u64, (u64)cal->cb_ns * PPSP_CALIB_LOAD, 1));
+	if (cal->jitter_ns)
+		rate = min_t(u64, rate, div_u64(1000000000ULL, 2 * cal->jitter_ns));
+	if (rate < PPSP_MIN_RATE__1)
+		printk(KERN_WARNING "PPSP: machine looks too slow even for %dHz\n",
+			PPSP_MIN_RATE__1);
+	/* an hr_thr given by the user wins */
+	if (!hr_thr_user)
+		hr_thr = clamp_t(u64, rate, PPSP_MIN_RATE__1, PPSP_MAX_RATE__1);
+	/* half-rate mode doubles what we can take */
+	chip->rate_max = clamp_t(u64, rate * 2, PPSP_MIN_RATE__1, PPSP_MAX_RATE__1);
+	cal->done = 1;
+
+	printk(KERN_INFO "PPSP: calibrated: outb=%uns cb=%uns late=%uns"
+		" jitter=%uns (max %lluns) -> hr_thr=%d%s rate_max=%u\n",
+		cal->outb_ns, cal->cb_ns, cal->late_ns, cal->jitter_ns,
+		ppsp_cal.late_max - cal->late_ns, hr_thr,
+		hr_thr_user ? " (user)" : "", chip->rate_max);
+}
@@ -0,0 +1,229 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * PP-Speaker driver for Linux
+ *
+ * Loopback capture of the values written to the dac.
+ * Copyright (C) 2022-2022  ariel/KotCzarny
+ */
+
+#include <linux/workqueue.h>
+#include <sound/core.h>
+#include <sound/pcm.h>
+#include "ppsp.h"
+#include <linux/version.h>
+
+/* same as for the playback, the pcm is nonatomic */
+static void ppsp_capture_elapsed(struct work_struct *work)
+{
+	if (atomic_read(&ppsp_chip.cap_active)) {
+		struct snd_pcm_substream *substream;
+		substream = ppsp_chip.capture_substream;
+		if (substream)
+			snd_pcm_period_elapsed(substream);
+	}
+}
+
+static DECLARE_WORK(ppsp_cap_work, ppsp_capture_elapsed);
+
+/*
+ * Store what the port holds after this tick, once per played frame;
+ * called from the hrtimer with irqs off. No playback, no frames.
+ */
+void ppsp_capture_emit(struct snd_ppsp *chip, u8 val, u8 val2)
+{
+	struct snd_pcm_substream *substream;
+	unsigned int periods = 0;
+	u8 *p;
+	int i;
+
+	spin_lock(&chip->capture_lock);
+	substream = chip->capture_substream;
+	if (!substream || !atomic_read(&chip->cap_active)) {
+		spin_unlock(&chip->capture_lock);
+		return;
+	}
+	for (i = 0; i < PPSP_INDEX_INC(); i++) {
+		p = substream->runtime->dma_area + chip->cap_ptr;
+		p[0] = val;
+		if (chip->cap_chans == 2)
+			p[1] = val2;
+		periods += ppsp_ptr_advance(&chip->cap_ptr,
+			&chip->cap_period_ptr, chip->cap_chans,
+			chip->cap_period_bytes, chip->cap_buffer_bytes);
+	}
+	spin_unlock(&chip->capture_lock);
+
+	if (periods)
+		queue_work(system_highpri_wq, &ppsp_cap_work);
+}
+
+static void ppsp_capture_quiesce(struct snd_ppsp *chip)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&chip->capture_lock, flags);
+	atomic_set(&chip->cap_active, 0);
+	spin_unlock_irqrestore(&chip->capture_lock, flags);
+	cancel_work_sync(&ppsp_cap_work);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+static int snd_ppsp_capture_sync_stop(struct snd_pcm_substream *substream)
+{
+	ppsp_capture_quiesce(snd_pcm_substream_chip(substream));
+	return 0;
+}
+#else
+static int snd_ppsp_capture_hw_params(struct snd_pcm_substream *substream,
+				      struct snd_pcm_hw_params *hw_params)
+{
+	ppsp_capture_quiesce(snd_pcm_substream_chip(substream));
+	return snd_pcm_lib_alloc_vmalloc_buffer(substream,
+					params_buffer_bytes(hw_params));
+}
+#endif
+
+static int snd_ppsp_capture_hw_free(struct snd_pcm_substream *substream)
+{
+	ppsp_capture_quiesce(snd_pcm_substream_chip(substream));
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+	return snd_pcm_lib_free_vmalloc_buffer(substream);
+#else
+	return 0;
+#endif
+}
+
+static int snd_ppsp_capture_prepare(struct snd_pcm_substream *substream)
+{
+	struct snd_ppsp *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_substream *play = chip->playback_substream;
+	unsigned long flags;
+
+	/* the frames come at the playback rate, whatever is asked */
+	if (play && play->runtime->rate &&
+	    play->runtime->rate != substream->runtime->rate) {
+		printk(KERN_ERR "PPSP: capture needs the playback rate %u\n",
+		       play->runtime->rate);
+		return -EINVAL;
+	}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+	ppsp_capture_quiesce(chip);
+#endif
+	spin_lock_irqsave(&chip->capture_lock, flags);
+	chip->cap_ptr = 0;
+	chip->cap_period_ptr = 0;
+	chip->cap_chans = substream->runtime->channels;
+	chip->cap_period_bytes = snd_pcm_lib_period_bytes(substream);
+	chip->cap_buffer_bytes = snd_pcm_lib_buffer_bytes(substream);
+	spin_unlock_irqrestore(&chip->capture_lock, flags);
+	return 0;
+}
+
+static int snd_ppsp_capture_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct snd_ppsp *chip = snd_pcm_substream_chip(substream);
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+	case SNDRV_PCM_TRIGGER_RESUME:
+		atomic_set(&chip->cap_active, 1);
+		break;
+	case SNDRV_PCM_TRIGGER_STOP:
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+		atomic_set(&chip->cap_active, 0);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static snd_pcm_uframes_t snd_ppsp_capture_pointer(struct snd_pcm_substream
+						  *substream)
+{
+	struct snd_ppsp *chip = snd_pcm_substream_chip(substream);
+	unsigned long flags;
+	size_t pos;
+
+	spin_lock_irqsave(&chip->capture_lock, flags);
+	pos = chip->cap_ptr;
+	spin_unlock_irqrestore(&chip->capture_lock, flags);
+	return bytes_to_frames(substream->runtime, pos);
+}
+
+static const struct snd_pcm_hardware snd_ppsp_capture = {
+	.info = (SNDRV_PCM_INFO_INTERLEAVED |
+		 SNDRV_PCM_INFO_RESUME |
+		 SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID),
+	/* the port values as they are, L and R for two ports */
+	.formats = SNDRV_PCM_FMTBIT_U8,
+	.rates = SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_8000_48000,
+	.rate_min = PPSP_MIN_RATE__1,
+	.rate_max = PPSP_MAX_RATE__1,
+	.channels_min = 1,
+	.channels_max = 2,
+	.buffer_bytes_max = PPSP_BUFFER_SIZE,
+	.period_bytes_min = 2,
+	.period_bytes_max = PPSP_MAX_PERIOD_SIZE,
+	.periods_min = 2,
+	.periods_max = PPSP_MAX_PERIODS,
+	.fifo_size = 0,
+};
+
+static int snd_ppsp_capture_open(struct snd_pcm_substream *substream)
+{
+	struct snd_ppsp *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_substream *play = chip->playback_substream;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	unsigned long flags;
+	int err;
+
+	runtime->hw = snd_ppsp_capture;
+	runtime->hw.rate_max = chip->rate_max;
+	err = snd_pcm_hw_constraint_integer(runtime,
+					    SNDRV_PCM_HW_PARAM_PERIODS);
+	if (err < 0)
+		return err;
+	/* lock to the playback rate when it is already known */
+	if (play && play->runtime->rate) {
+		err = snd_pcm_hw_constraint_minmax(runtime,
+			SNDRV_PCM_HW_PARAM_RATE,
+			play->runtime->rate, play->runtime->rate);
+		if (err < 0)
+			return err;
+	}
+	spin_lock_irqsave(&chip->capture_lock, flags);
+	chip->capture_substream = substream;
+	spin_unlock_irqrestore(&chip->capture_lock, flags);
+	return 0;
+}
+
+static int snd_ppsp_capture_close(struct snd_pcm_substream *substream)
+{
+	struct snd_ppsp *chip = snd_pcm_substream_chip(substream);
+	unsigned long flags;
+
+	ppsp_capture_quiesce(chip);
+	spin_lock_irqsave(&chip->capture_lock, flags);
+	chip->capture_substream = NULL;
+	spin_unlock_irqrestore(&chip->capture_lock, flags);
+	return 0;
+}
+
+const struct snd_pcm_ops snd_ppsp_capture_ops = {
+	.open = snd_ppsp_capture_open,
+	.close = snd_ppsp_capture_close,
+	.ioctl = snd_pcm_lib_ioctl,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+	.hw_params = snd_ppsp_capture_hw_params,
+#else
+	.sync_stop = snd_ppsp_capture_sync_stop,
+#endif
+	.hw_free = snd_ppsp_capture_hw_free,
+	.prepare = snd_ppsp_capture_prepare,
+	.trigger = snd_ppsp_capture_trigger,
+	.pointer = snd_ppsp_capture_pointer,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+	.page = snd_pcm_lib_get_vmalloc_page,
+#endif
+};
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * PP-Speaker driver for Linux
+ *
+ * Decoding of the 8-bit and compressed input formats.
+ * Copyright (C) 2022-2022  ariel/KotCzarny
+ */
+
+#include <linux/kernel.h>
+#include "ppsp.h"
+
+/* 8-bit formats to s16, one lookup per sample */
+s16 ppsp_xlat_u8[256];
+s16 ppsp_xlat_ulaw[256];
+s16 ppsp_xlat_alaw[256];
+
+static const s16 ppsp_ima_step[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const s8 ppsp_ima_index[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+/* G.711 */
+static s16 ppsp_ulaw2lin(u8 u)
+{
+	int t;
+
+	u = ~u;
+	t = ((u & 0x0f) << 3) + 0x84;
+	t <<= (u & 0x70) >> 4;
+	return (u & 0x80) ? (0x84 - t) : (t - 0x84);
+}
+
+static s16 ppsp_alaw2lin(u8 a)
+{
+	int t, seg;
+
+	a ^= 0x55;
+	t = (a & 0x0f) << 4;
+	seg = (a & 0x70) >> 4;
+	switch (seg) {
+	case 0:
+		t += 8;
+		break;
+	case 1:
+		t += 0x108;
+		break;
+	default:
+		t += 0x108;
+		t <<= seg - 1;
+	}
+	return (a & 0x80) ? t : -t;
+}
+
+int ppsp_adpcm_decode(struct ppsp_adpcm *st, u8 code)
+{
+	int step = ppsp_ima_step[st->index];
+	int diff = step >> 3;
+
+	if (code & 4)
+		diff += step;
+	if (code & 2)
+		diff += step >> 1;
+	if (code & 1)
+		diff += step >> 2;
+	if (code & 8)
+		st->pred = max(st->pred - diff, -32768);
+	else
+		st->pred = min(st->pred + diff, 32767);
+	st->index = clamp(st->index + ppsp_ima_index[code], 0, 88);
+	return st->pred;
+}
+
+void ppsp_codec_init(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		ppsp_xlat_u8[i] = (s8)(i ^ 0x80) * 256;
+		ppsp_xlat_ulaw[i] = ppsp_ulaw2lin(i);
+		ppsp_xlat_alaw[i] = ppsp_alaw2lin(i);
+	}
+}
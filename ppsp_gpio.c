@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * PP-Speaker driver for Linux
+ *
+ * R-2R DAC on GPIO lines, instead of the parallel port.
+ * Copyright (C) 2022-2022  ariel/KotCzarny
+ */
+
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/machine.h>
+#include "ppsp.h"
+
+#if PPSP_GPIO
+
+#define PPSP_GPIO_BITS		8
+#define PPSP_GPIO_WRITES	256
+
+static struct gpiod_lookup_table *ppsp_gpio_table;
+
+/*
+ * The lines are the "dac" gpios of the device: from the firmware
+ * (dac-gpios in DT), or gpio_chip/gpio_offset given as params, which
+ * map 8 consecutive lines of that chip, LSB first
+ */
+static int ppsp_gpio_add_table(struct device *dev)
+{
+	int i;
+
+	ppsp_gpio_table = kzalloc(struct_size(ppsp_gpio_table, table,
+					      PPSP_GPIO_BITS + 1), GFP_KERNEL);
+	if (!ppsp_gpio_table)
+		return -ENOMEM;
+	ppsp_gpio_table->dev_id = dev_name(dev);
+	for (i = 0; i < PPSP_GPIO_BITS; i++)
+		ppsp_gpio_table->table[i] = (struct gpiod_lookup)
+			GPIO_LOOKUP_IDX(gpio_chip, gpio_offset + i, "dac", i,
+					GPIO_ACTIVE_HIGH);
+	gpiod_add_lookup_table(ppsp_gpio_table);
+	return 0;
+}
+
+static void ppsp_gpio_remove_table(void)
+{
+	if (!ppsp_gpio_table)
+		return;
+	gpiod_remove_lookup_table(ppsp_gpio_table);
+	kfree(ppsp_gpio_table);
+	ppsp_gpio_table = NULL;
+}
+
+static u8 ppsp_gpio_val;
+
+/* lines that sleep (i2c expanders, gpio-sim) are written from here */
+static void ppsp_gpio_deferred(struct work_struct *work)
+{
+	struct gpio_descs *descs = ppsp_chip.dac_gpios;
+	unsigned long bits = READ_ONCE(ppsp_gpio_val);
+
+	if (descs)
+		gpiod_set_array_value_cansleep(descs->ndescs, descs->desc,
+					       descs->info, &bits);
+}
+
+static DECLARE_WORK(ppsp_gpio_work, ppsp_gpio_deferred);
+
+/*
+ * With the lines consecutive on one chip gpiolib takes the fast
+ * bitmap path, a single register write per sample on most chips.
+ * Sleeping lines only get the latest value when the work runs, so
+ * they are decimated to at most one write per gpio_write_ns, which
+ * is fine for checking the wiring but not for listening. The work is
+ * queued only on a change, not on every tick.
+ */
+void ppsp_gpio_write(struct snd_ppsp *chip, u8 val)
+{
+	unsigned long bits = val;
+
+	if (unlikely(chip->gpio_sleeps)) {
+		if (val == READ_ONCE(ppsp_gpio_val))
+			return;
+		WRITE_ONCE(ppsp_gpio_val, val);
+		queue_work(system_highpri_wq, &ppsp_gpio_work);
+		return;
+	}
+	gpiod_set_array_value(chip->dac_gpios->ndescs, chip->dac_gpios->desc,
+			      chip->dac_gpios->info, &bits);
+}
+
+int ppsp_gpio_init(struct snd_ppsp *chip, struct device *dev)
+{
+	struct gpio_descs *descs;
+	unsigned long flags, bits;
+	ktime_t t0, t1;
+	int i, err;
+
+	if (gpio_chip && *gpio_chip) {
+		err = ppsp_gpio_add_table(dev);
+		if (err < 0)
+			return err;
+	}
+
+	descs = gpiod_get_array_optional(dev, "dac", GPIOD_OUT_LOW);
+	if (IS_ERR(descs)) {
+		err = PTR_ERR(descs);
+		printk(KERN_ERR "PPSP: cannot get the GPIO DAC lines (%d)\n", err);
+		goto remove_table;
+	}
+	/* no gpio dac, the port it is */
+	if (!descs) {
+		ppsp_gpio_remove_table();
+		return 0;
+	}
+
+	err = -EINVAL;
+	if (descs->ndescs != PPSP_GPIO_BITS) {
+		printk(KERN_ERR "PPSP: GPIO DAC needs %d lines, got %u\n",
+			PPSP_GPIO_BITS, descs->ndescs);
+		goto put_descs;
+	}
+	chip->gpio_sleeps = 0;
+	for (i = 0; i < descs->ndescs; i++)
+		if (gpiod_cansleep(descs->desc[i]))
+			chip->gpio_sleeps = 1;
+	chip->dac_gpios = descs;
+
+	if (chip->gpio_sleeps) {
+		/* the hrtimer cannot write them, see ppsp_gpio_write() */
+		printk(KERN_WARNING "PPSP: GPIO DAC lines can sleep, they are "
+			"written from a work, only good for testing\n");
+		bits = 0;
+		t0 = ktime_get();
+		for (i = 0; i < PPSP_GPIO_WRITES; i++)
+			gpiod_set_array_value_cansleep(descs->ndescs,
+				descs->desc, descs->info, &bits);
+		t1 = ktime_get();
+	} else {
+		local_irq_save(flags);
+		t0 = ktime_get();
+		for (i = 0; i < PPSP_GPIO_WRITES; i++)
+			ppsp_gpio_write(chip, 0);
+		t1 = ktime_get();
+		local_irq_restore(flags);
+	}
+	chip->gpio_write_ns = div_u64(ktime_to_ns(ktime_sub(t1, t0)),
+				      PPSP_GPIO_WRITES);
+
+	printk(KERN_INFO "PPSP: GPIO DAC, %s path%s, %uns per write\n",
+		descs->info ? "fast" : "slow",
+		chip->gpio_sleeps ? ", sleeping" : "", chip->gpio_write_ns);
+	if (chip->gpio_sleeps && chip->gpio_write_ns)
+		printk(KERN_INFO "PPSP: GPIO DAC updates at most %ldHz\n",
+			NSEC_PER_SEC / chip->gpio_write_ns);
+	return 0;
+
+put_descs:
+	gpiod_put_array(descs);
+remove_table:
+	ppsp_gpio_remove_table();
+	return err;
+}
+
+void ppsp_gpio_exit(struct snd_ppsp *chip)
+{
+	if (chip->dac_gpios) {
+		cancel_work_sync(&ppsp_gpio_work);
+		gpiod_put_array(chip->dac_gpios);
+		chip->dac_gpios = NULL;
+	}
+	ppsp_gpio_remove_table();
+}
+
+#endif
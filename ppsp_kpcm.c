@@ -0,0 +1,316 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * PP-Speaker driver for Linux
+ *
+ * In-kernel PCM producer.
+ * Copyright (C) 2022-2022  ariel/KotCzarny
+ */
+
+#include <linux/module.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
+#include <sound/core.h>
+#include <sound/pcm.h>
+#include "ppsp.h"
+#include "ppsp_kpcm.h"
+
+/* mono samples, about 1.4s at 48kHz */
+#define PPSP_KPCM_FIFO	65536
+
+/*
+ * The queued samples go through the same tick as the pcm: mixed into a
+ * running stream at its rate, or with no pcm open the kernel stream runs
+ * the timer itself at the rate of its blocks. Resampling is a plain
+ * sample-and-hold, which is plenty for beeps and speech.
+ *
+ * Queueing only touches the fifo under k->lock, so it works from any
+ * context; starting and stopping the timer sleeps (sync, qos, the ramp
+ * to the midpoint), that is left to ppsp_kpcm_work. So with no pcm a
+ * sound starts one highpri work wakeup and the ramp after it is queued,
+ * not within a sample period; mixed into a running pcm it starts at the
+ * next tick.
+ */
+
+/* source samples per tick, 16.16; with k->lock held */
+static void ppsp_kpcm_step(struct snd_ppsp *chip)
+{
+	struct ppsp_kpcm *k = &chip->kpcm;
+
+	k->step = div_u64((u64)k->rate << (16 + chip->half_rate),
+			  chip->srate);
+}
+
+/*
+ * Next kernel sample for this tick, 0 if none; *preempt tells it comes
+ * from a preempting block. Called with irqs off. The fifo is only
+ * looked at under k->lock while ready, ppsp_kpcm_exit() frees it.
+ */
+int ppsp_kpcm_tick(struct snd_ppsp *chip, int *s, bool *preempt)
+{
+	struct ppsp_kpcm *k = &chip->kpcm;
+	s16 v;
+	int ret = 0;
+
+	spin_lock(&k->lock);
+	if (k->ready && kfifo_peek(&k->fifo, &v)) {
+		*s = v;
+		*preempt = k->preempt_left != 0;
+		ret = 1;
+		k->phase += k->step;
+		while (k->phase >= 0x10000 && !kfifo_is_empty(&k->fifo)) {
+			k->phase -= 0x10000;
+			kfifo_skip(&k->fifo);
+			if (k->preempt_left)
+				k->preempt_left--;
+		}
+	}
+	spin_unlock(&k->lock);
+	return ret;
+}
+
+/* the pcm rate is known now, called from prepare */
+void ppsp_kpcm_retime(struct snd_ppsp *chip)
+{
+	struct ppsp_kpcm *k = &chip->kpcm;
+	unsigned long flags;
+
+	spin_lock_irqsave(&k->lock, flags);
+	if (k->rate)
+		ppsp_kpcm_step(chip);
+	spin_unlock_irqrestore(&k->lock, flags);
+}
+
+/* stop the timer the kernel stream runs, with k->mutex held */
+static void ppsp_kpcm_halt(struct snd_ppsp *chip)
+{
+	struct ppsp_kpcm *k = &chip->kpcm;
+
+	atomic_set(&k->drained, 0);
+	if (!atomic_read(&k->on))
+		return;
+	atomic_set(&k->on, 0);
+	/* also drops the qos request and brings the port down */
+	ppsp_sync_stop(chip);
+}
+
+/* start the timer for the queued samples, with k->mutex held */
+static void ppsp_kpcm_run(struct snd_ppsp *chip)
+{
+	struct ppsp_kpcm *k = &chip->kpcm;
+	unsigned long flags;
+
+	if (!k->ready || k->held || chip->playback_substream ||
+	    atomic_read(&chip->timer_active) || kfifo_is_empty(&k->fifo))
+		return;
+	atomic_set(&k->on, 1);
+	ppsp_start_kernel(chip, k->rate);
+	spin_lock_irqsave(&k->lock, flags);
+	ppsp_kpcm_step(chip);
+	spin_unlock_irqrestore(&k->lock, flags);
+}
+
+/*
+ * Bring the timer in line with the fifo: stop it when the tick found
+ * the fifo dry, start it for what was queued since
+ */
+static void ppsp_kpcm_sync(struct work_struct *work)
+{
+	struct snd_ppsp *chip = &ppsp_chip;
+	struct ppsp_kpcm *k = &chip->kpcm;
+
+	mutex_lock(&k->mutex);
+	if (atomic_read(&k->drained))
+		ppsp_kpcm_halt(chip);
+	ppsp_kpcm_run(chip);
+	mutex_unlock(&k->mutex);
+}
+
+static DECLARE_WORK(ppsp_kpcm_work, ppsp_kpcm_sync);
+
+/*
+ * From the tick the kernel stream drives; true stops the timer. It stays
+ * marked active until the work stopped it properly, so nothing starts it
+ * again meanwhile.
+ */
+bool ppsp_kpcm_drained(struct snd_ppsp *chip)
+{
+	struct ppsp_kpcm *k = &chip->kpcm;
+	bool empty;
+
+	spin_lock(&k->lock);
+	empty = !k->ready || kfifo_is_empty(&k->fifo);
+	spin_unlock(&k->lock);
+	if (!empty)
+		return false;
+	atomic_set(&k->drained, 1);
+	queue_work(system_highpri_wq, &ppsp_kpcm_work);
+	return true;
+}
+
+/* the pcm is opened, it takes the timer over; what is queued waits */
+void ppsp_kpcm_yield(struct snd_ppsp *chip)
+{
+	struct ppsp_kpcm *k = &chip->kpcm;
+
+	mutex_lock(&k->mutex);
+	k->held = 1;
+	ppsp_kpcm_halt(chip);
+	mutex_unlock(&k->mutex);
+}
+
+/* the pcm is closed, or its open failed; play what is left */
+void ppsp_kpcm_kick(struct snd_ppsp *chip)
+{
+	struct ppsp_kpcm *k = &chip->kpcm;
+
+	mutex_lock(&k->mutex);
+	k->held = 0;
+	ppsp_kpcm_run(chip);
+	mutex_unlock(&k->mutex);
+}
+
+/**
+ * snd_ppsp_kqueue - queue mono samples for playback
+ * @buf: the samples
+ * @count: number of samples in @buf
+ * @fmt: PPSP_KPCM_U8 or PPSP_KPCM_S16
+ * @rate: sample rate of @buf
+ * @flags: PPSP_KPCM_PREEMPT or 0
+ *
+ * Mixed into the pcm stream when it runs, from its next tick. Played on
+ * its own when no pcm is open: the timer is then started from a highpri
+ * work, so playback begins after that work runs and the port is ramped
+ * to the midpoint (up to 128 port writes), with no bound of a sample
+ * period. Blocks queued back to back must share the rate, unless
+ * preempting; a preempting block replaces the pcm only for its own
+ * samples. Can be called from any context.
+ *
+ * Returns the number of samples queued, -EBUSY when the pcm is open but
+ * not running or the rate differs from what is queued.
+ */
+int snd_ppsp_kqueue(const void *buf, size_t count, int fmt,
+		    unsigned int rate, unsigned int flags)
+{
+	struct snd_ppsp *chip = &ppsp_chip;
+	struct ppsp_kpcm *k = &chip->kpcm;
+	unsigned long irqflags;
+	bool pcm;
+	size_t i;
+	s16 v;
+
+	if (!buf || (fmt != PPSP_KPCM_U8 && fmt != PPSP_KPCM_S16) ||
+	    rate < PPSP_MIN_RATE__1 || rate > PPSP_MAX_RATE__1)
+		return -EINVAL;
+	/* open and close change the substream under this lock */
+	spin_lock_irqsave(&chip->substream_lock, irqflags);
+	pcm = chip->playback_substream != NULL;
+	if (pcm && !atomic_read(&chip->timer_active)) {
+		spin_unlock_irqrestore(&chip->substream_lock, irqflags);
+		return -EBUSY;
+	}
+	spin_unlock_irqrestore(&chip->substream_lock, irqflags);
+
+	spin_lock_irqsave(&k->lock, irqflags);
+	if (!k->ready) {
+		spin_unlock_irqrestore(&k->lock, irqflags);
+		return -ENODEV;
+	}
+	if (flags & PPSP_KPCM_PREEMPT)
+		kfifo_reset(&k->fifo);
+	if (kfifo_is_empty(&k->fifo)) {
+		k->rate = rate;
+		k->phase = 0;
+		k->preempt_left = 0;
+		ppsp_kpcm_step(chip);
+	} else if (rate != k->rate) {
+		spin_unlock_irqrestore(&k->lock, irqflags);
+		return -EBUSY;
+	}
+	for (i = 0; i < count; i++) {
+		if (fmt == PPSP_KPCM_U8)
+			v = (s16)((((const u8 *)buf)[i] ^ 0x80) << 8);
+		else
+			v = ((const s16 *)buf)[i];
+		if (!kfifo_put(&k->fifo, v))
+			break;
+	}
+	/* the fifo was reset, so these are at its head */
+	if (flags & PPSP_KPCM_PREEMPT)
+		k->preempt_left = i;
+	spin_unlock_irqrestore(&k->lock, irqflags);
+
+	/* the work checks again under k->mutex, a pcm opened since wins */
+	if (i && !pcm)
+		queue_work(system_highpri_wq, &ppsp_kpcm_work);
+	return i;
+}
+EXPORT_SYMBOL_GPL(snd_ppsp_kqueue);
+
+/**
+ * snd_ppsp_kflush - drop the queued samples
+ *
+ * A kernel stream playing alone stops at its next tick. Can be called
+ * from any context.
+ */
+void snd_ppsp_kflush(void)
+{
+	struct ppsp_kpcm *k = &ppsp_chip.kpcm;
+	unsigned long flags;
+
+	spin_lock_irqsave(&k->lock, flags);
+	kfifo_reset(&k->fifo);
+	k->preempt_left = 0;
+	spin_unlock_irqrestore(&k->lock, flags);
+}
+EXPORT_SYMBOL_GPL(snd_ppsp_kflush);
+
+/* drop everything and stop now, for suspend and shutdown; may sleep */
+void ppsp_kpcm_stop(struct snd_ppsp *chip)
+{
+	struct ppsp_kpcm *k = &chip->kpcm;
+
+	snd_ppsp_kflush();
+	cancel_work_sync(&ppsp_kpcm_work);
+	mutex_lock(&k->mutex);
+	ppsp_kpcm_halt(chip);
+	mutex_unlock(&k->mutex);
+}
+
+int ppsp_kpcm_init(struct snd_ppsp *chip)
+{
+	struct ppsp_kpcm *k = &chip->kpcm;
+	int err;
+
+	spin_lock_init(&k->lock);
+	mutex_init(&k->mutex);
+	atomic_set(&k->on, 0);
+	atomic_set(&k->drained, 0);
+	k->held = 0;
+	k->rate = 0;
+	k->preempt_left = 0;
+	err = kfifo_alloc(&k->fifo, PPSP_KPCM_FIFO, GFP_KERNEL);
+	if (err)
+		return err;
+	k->ready = 1;
+	return 0;
+}
+
+/*
+ * After snd_card_free(), which stopped and synced every pcm stream;
+ * a close on the way may have restarted the kernel stream, stop it too
+ */
+void ppsp_kpcm_exit(struct snd_ppsp *chip)
+{
+	struct ppsp_kpcm *k = &chip->kpcm;
+	unsigned long flags;
+
+	spin_lock_irqsave(&k->lock, flags);
+	k->ready = 0;
+	spin_unlock_irqrestore(&k->lock, flags);
+	ppsp_kpcm_stop(chip);
+	/* a last tick before the timer stopped may have queued it */
+	cancel_work_sync(&ppsp_kpcm_work);
+	spin_lock_irqsave(&k->lock, flags);
+	kfifo_free(&k->fifo);
+	spin_unlock_irqrestore(&k->lock, flags);
+}
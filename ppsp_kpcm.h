@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * PP-Speaker driver for Linux
+ *
+ * In-kernel PCM producer, for kernel clients like a soft synth or the bell.
+ * Copyright (C) 2022-2022  ariel/KotCzarny
+ */
+
+#ifndef __PPSP_KPCM_H__
+#define __PPSP_KPCM_H__
+
+#include <linux/types.h>
+
+#define PPSP_KPCM_U8		0
+#define PPSP_KPCM_S16		1	/* native endian */
+
+/* drop what is queued, and mute the pcm stream while it plays */
+#define PPSP_KPCM_PREEMPT	0x1
+
+int snd_ppsp_kqueue(const void *buf, size_t count, int fmt,
+		    unsigned int rate, unsigned int flags);
+void snd_ppsp_kflush(void);
+
+#endif
@@ -12,7 +12,9 @@
 #include <linux/gfp.h>
 #include <linux/moduleparam.h>
 #include <linux/interrupt.h>
+#include <linux/workqueue.h>
 #include <linux/io.h>
+#include <linux/math64.h>
 #include <sound/pcm.h>
 #include "ppsp.h"
 #include <linux/version.h>
@@ -20,10 +22,10 @@
 #define DMIX_WANTS_S16	1
 
 /*
- * Call snd_pcm_period_elapsed in a tasklet
- * This avoids spinlock messes and long-running irq contexts
+ * Call snd_pcm_period_elapsed in a work
+ * The pcm is nonatomic, so it has to be called from a sleepable context
  */
-static void ppsp_call_pcm_elapsed(unsigned long priv)
+static void ppsp_call_pcm_elapsed(struct work_struct *work)
 {
 	if (atomic_read(&ppsp_chip.timer_active)) {
 		struct snd_pcm_substream *substream;
@@ -33,7 +35,7 @@ static void ppsp_call_pcm_elapsed(unsigned long priv)
 	}
 }
 
-static DECLARE_TASKLET(ppsp_pcm_tasklet, ppsp_call_pcm_elapsed, 0);
+static DECLARE_WORK(ppsp_pcm_work, ppsp_call_pcm_elapsed);
 
 //#include <linux/time.h>
 #if PPSP_DEBUG
@@ -47,25 +49,125 @@ static void gett(char *t) {
 static u32 ppsp_i=0;
 #endif
 
-#define PPSP_DUMP 0
+/* fetch one sample of the buffer as s16 */
+static inline int ppsp_get_s16(struct snd_ppsp *chip, const u8 *p)
+{
+	/* U8 and the companded formats */
+	if (chip->xlat)
+		return chip->xlat[p[0]];
+	return (s16)(p[0] | (p[1] << 8));
+}
 
-#if PPSP_DUMP
-static u32 ppsp_i2=0;
-struct file * ppsp_dbgfp=NULL;
-char ppsp_dbgbuf[128];
-loff_t ppsp_dbgoff=0;
-#endif
+/*
+ * IMA ADPCM has no random access, each nibble is decoded once and in
+ * order; the first sample is in the high nibble, as alsa-lib packs it
+ */
+static void ppsp_adpcm_tick(struct snd_ppsp *chip, const u8 *area,
+			    int *accl, int *accr)
+{
+	long nibbles = chip->buffer_bytes * 2;
+	long n = chip->playback_ptr * 2 + (chip->bit_phase >> 2);
+	int i, ch, v = 0;
+	u8 b;
+
+	if (unlikely(chip->toggle1)) {
+		/* toggle1 shifts the read by whole frames, chans nibbles each */
+		n += chip->toggle1 * (long)chip->chans;
+		if (n < 0)
+			n += nibbles;
+		else
+			n %= nibbles;
+	}
+	/* the state only follows a contiguous read, restart it on a jump */
+	if (unlikely((size_t)n != chip->adpcm_next))
+		memset(chip->adpcm, 0, sizeof(chip->adpcm));
+
+	for (i = 0; i < PPSP_INDEX_INC(); i++) {
+		for (ch = 0; ch < chip->chans; ch++, n++) {
+			if (unlikely(n >= nibbles))
+				n -= nibbles;
+			b = area[n >> 1];
+			v = ppsp_adpcm_decode(&chip->adpcm[ch],
+					      (n & 1) ? b & 0x0f : b >> 4);
+			if (ch)
+				*accr += v;
+			else
+				*accl += v;
+		}
+		if (chip->chans == 1)
+			*accr += v;
+	}
+	chip->adpcm_next = n < nibbles ? n : n - nibbles;
+}
+
+/*
+ * Requantize s16 to the 8-bit port value. With noise shaping the
+ * quantization error is fed back through the selected filter, which
+ * pushes the noise up towards nyquist instead of leaving it flat:
+ *  1st order: NTF = 1 - z^-1
+ *  2nd order: NTF = (1 - z^-1)^2
+ */
+static inline u8 ppsp_requant(struct snd_ppsp *chip, int ch, int x)
+{
+	int *err = chip->ns_err[ch];
+	int u, q, e;
+
+	switch (chip->nshape) {
+	case PPSP_NSHAPE_1ST:
+		u = x - err[0];
+		break;
+	case PPSP_NSHAPE_2ND:
+		u = x - 2 * err[0] + err[1];
+		break;
+	default:
+		/* plain truncation, as the MSB byte would give */
+		q = clamp(x >> 8, -128, 127);
+		return (u8)q ^ 0x80;
+	}
+	q = clamp((u + 0x80) >> 8, -128, 127);
+	/* bound the error, clipping would make the loop run away */
+	e = clamp(q * 256 - u, -0x100, 0x100);
+	err[1] = err[0];
+	err[0] = e;
+	return (u8)q ^ 0x80;
+}
+
+/*
+ * The timer was armed spin_margin early, wait here for the real
+ * deadline. The margin follows a decaying peak of the wakeup lateness,
+ * so the spin stays as short as the jitter allows.
+ */
+static void ppsp_spin(struct snd_ppsp *chip)
+{
+	ktime_t now = ktime_get();
+	s64 late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(&chip->timer)));
+	s64 left = ktime_to_ns(ktime_sub(chip->deadline, now));
+
+	late = clamp_t(s64, late, 0, chip->spin_max);
+	if (late > chip->spin_jit)
+		chip->spin_jit = late;
+	else
+		chip->spin_jit -= chip->spin_jit >> 6;
+	chip->spin_margin = min(chip->spin_jit + chip->spin_jit / 4,
+				chip->spin_max);
+
+	if (left <= 0) {
+		chip->spin_late++;
+		return;
+	}
+	while (ktime_before(ktime_get(), chip->deadline))
+		cpu_relax();
+	chip->spin_ticks++;
+	chip->spin_total_ns += ktime_to_ns(ktime_sub(ktime_get(), now));
+}
 
 /* write the port and returns the next expire time in ns;
  * called at the trigger-start and in hrtimer callback
  */
 static u64 ppsp_timer_update(struct snd_ppsp *chip)
 {
-	u8 val[4]; int div; u64 pos;
-#if PPSP_DUMP
-//	s16 vs[16];
-	u8 vs[16];
-#endif
+	u8 val, val2; const u8 *base; int i, l, ks, acc, accl, accr; long off; u64 ns;
+	bool preempt;
 	struct snd_pcm_substream *substream;
 	struct snd_pcm_runtime *runtime;
 #if PPSP_DEBUG
@@ -75,19 +177,18 @@ static u64 ppsp_timer_update(struct snd_ppsp *chip)
 	unsigned long flags;
 #endif
 
-#if PPSP_DUMP
-	size_t ppsp_dbglen;
-	if(!ppsp_dbgfp) ppsp_dbgfp=filp_open("/tmp/ppsp_dump.txt",
-		O_WRONLY | O_CREAT | O_TRUNC, 0600);
-#endif
-
+	/* no pcm when the kernel stream plays alone */
 	substream = chip->playback_substream;
-	if (!substream)
+	if (!substream && !atomic_read(&chip->kpcm.on))
 		return 0;
 
+	/* before the irqs go off, the spin is up to spin_max long */
+	if (chip->spin_max)
+		ppsp_spin(chip);
+
 	local_irq_disable();
 
-	runtime = substream->runtime;
+	runtime = substream ? substream->runtime : NULL;
 	/* assume it is mono! */
 /*
 One thing to be noted is that the configured buffer and period sizes are stored in
@@ -104,63 +205,60 @@ The DMA buffer is defined by the following four fields, dma_area, dma_addr, dma_
  buffer. This field is specified only when the buffer is a linear buffer. dma_bytes holds
  the size of buffer in bytes. dma_private is used for the ALSA DMA allocator.
 */
-	pos=chip->playback_ptr + chip->fmt_size - 1 + chip->toggle1;
-	div=chip->chans*(chip->half_rate+1);
-	val[0] = runtime->dma_area[pos];
-
-	switch(div) {
-		case 2:
-			val[1] = runtime->dma_area[pos+chip->fmt_size];
-			val[0] = ((((val[0]<<24)/div + (val[1]<<24)/div))>>24)&0xff;
-			break;
-		case 4:
-			val[1] = runtime->dma_area[pos+chip->fmt_size];
-			val[2] = runtime->dma_area[pos+chip->fmt_size*2];
-			val[3] = runtime->dma_area[pos+chip->fmt_size*3];
-			val[0] = ((((val[0]<<24)/div + (val[1]<<24)/div
-			 + (val[2]<<24)/div + (val[3]<<24)/div))>>24)&0xff;
-			break;
-	}
-
-	if(chip->volume!=30) {
-		val[0] = (((val[0]<<24)/30*chip->volume)>>24)&0xff;
+	/* half-rate decimate (and downmix) at 16 bits, then requantize */
+	accl = accr = 0;
+	if (!runtime) {
+		/* silence, the kernel samples go on top */
+	} else if (unlikely(chip->is_adpcm)) {
+		ppsp_adpcm_tick(chip, runtime->dma_area, &accl, &accr);
+	} else {
+		off = (long)chip->playback_ptr;
+		if (unlikely(chip->toggle1)) {
+			/* toggle1 shifts the read by whole frames */
+			off += chip->toggle1 * (long)chip->frame_bytes;
+			if (off < 0)
+				off += chip->buffer_bytes;
+			else
+				off %= chip->buffer_bytes;
+		}
+		for (i = 0; i < PPSP_INDEX_INC(); i++, off += chip->frame_bytes) {
+			/* ticks never straddle the buffer end, see the open constraints,
+			 * only toggle1 can get us here */
+			if (unlikely(off >= (long)chip->buffer_bytes))
+				off -= chip->buffer_bytes;
+			base = runtime->dma_area + off;
+			l = ppsp_get_s16(chip, base);
+			accl += l;
+			accr += chip->chans == 2 ? ppsp_get_s16(chip, base + chip->fmt_size) : l;
+		}
 	}
-
-#if PPSP_DUMP
-	memcpy(&vs, runtime->dma_area+chip->playback_ptr, sizeof(vs[0])*8);
-	ppsp_i2++; if(ppsp_i2>chip->srate/4) { ppsp_i2=0; } if(ppsp_i2<20)
-	{
-		switch(sizeof(vs[0])) {
-			case 1:
-				snprintf(ppsp_dbgbuf, 127, "%lld"
-				" %02hx %02hx %02hx %02hx,"" %02hx %02hx %02hx %02hx,"
-//				" %02hx %02hx %02hx %02hx,"" %02hx %02hx %02hx %02hx,"
-				" hr%d s%d %02x %02x (%hhd %hhd)\n", ppsp_dbgoff,
-				vs[0], vs[1], vs[2], vs[3],  vs[4], vs[5], vs[6], vs[7],
-//				vs[8], vs[9], vs[10], vs[11],  vs[12], vs[13], vs[14], vs[15],
-				chip->half_rate, chip->is_signed, val, val ^ 0x80
-				, val[0], val[0] ^ 0x80);
-				break;
-			case 2:
-				snprintf(ppsp_dbgbuf, 127, "%lld"
-				" %04hx %04hx %04hx %04hx,"" %04hx %04hx %04hx %04hx,"
-//				" %04hx %04hx %04hx %04hx,"" %04hx %04hx %04hx %04hx,"
-				" hr%d s%d %02x %02x (%hhd %hhd)\n", ppsp_dbgoff,
-				vs[0], vs[1], vs[2], vs[3],  vs[4], vs[5], vs[6], vs[7],
-//				vs[8], vs[9], vs[10], vs[11],  vs[12], vs[13], vs[14], vs[15],
-				chip->half_rate, chip->is_signed, val, val ^ 0x80
-				, val[0], val[0] ^ 0x80);
-				break;
+	accl >>= chip->half_rate;
+	accr >>= chip->half_rate;
+
+	/* in-kernel producer, see ppsp_kpcm.c */
+	if (ppsp_kpcm_tick(chip, &ks, &preempt)) {
+		if (preempt)
+			accl = accr = ks;
+		else {
+			accl += ks;
+			accr += ks;
 		}
-		ppsp_dbgbuf[127]=0;
-		ppsp_dbglen=strlen(ppsp_dbgbuf);
-		kernel_write(ppsp_dbgfp, ppsp_dbgbuf, ppsp_dbglen, &ppsp_dbgoff);
 	}
-#endif
 
-	if (chip->is_signed)
-	{
-		val[0] ^= 0x80;
+	if (chip->port2) {
+		/* L and R to their own ports */
+		if(chip->volume!=30) {
+			accl = accl * chip->volume / 30;
+			accr = accr * chip->volume / 30;
+		}
+		val = ppsp_requant(chip, 0, accl);
+		val2 = chip->chans == 2 ? ppsp_requant(chip, 1, accr) : val;
+	} else {
+		acc = (accl + accr) >> 1;
+		if(chip->volume!=30) {
+			acc = acc * chip->volume / 30;
+		}
+		val = val2 = ppsp_requant(chip, 0, acc);
 	}
 
 	if (chip->enable) {
@@ -176,23 +274,31 @@ The DMA buffer is defined by the following four fields, dma_area, dma_addr, dma_
 #if PPSP_DEBUG
 		if(debug>=2 && (ppsp_i % chip->srate) == 0) {
 			gett(tt);
-			outb(val[0], chip->port);
+			ppsp_out(chip, val, val2);
 			gett(tt2);
 			printk(KERN_INFO "%s\n%s\n",tt,tt2);
 		} else
 #endif
-			outb(val[0], chip->port);
+			ppsp_out(chip, val, val2);
 
 #if PPSP_I8253
 		raw_spin_unlock_irqrestore(&i8253_lock, flags);
 #endif
-		chip->last_val=val[0];
+		chip->last_val=val;
+		chip->last_val2=val2;
 	}
+	/* when the sample hit the wire, published by ppsp_pointer_update() */
+	chip->emit_time = ktime_get();
+	if (unlikely(ppsp_trace_on))
+		ppsp_trace_emit(chip, val, val2);
+	/* what the port holds now, muted or not; only for the pcm */
+	if (runtime && atomic_read(&chip->cap_active))
+		ppsp_capture_emit(chip, chip->last_val, chip->last_val2);
 
 	local_irq_enable();
 
 #if PPSP_DEBUG
-	if(debug && (ppsp_i % chip->srate) == 0) {
+	if(debug && runtime && (ppsp_i % chip->srate) == 0) {
 		gett(tt);
                 printk(KERN_INFO "PPSP: %s i=%d val=0x%04x srate=%d hr=%d ns=%lld\n",
 		tt, ppsp_i, val, chip->srate, chip->half_rate, chip->NS);
@@ -202,58 +308,45 @@ The DMA buffer is defined by the following four fields, dma_area, dma_addr, dma_
 		);
 	}
 #endif
-	return chip->NS;
+	/* spread the sub-ns remainder over the ticks, so the rate is exact */
+	ns = chip->NS;
+	chip->ns_acc += chip->ns_rem;
+	if (chip->ns_acc >= chip->srate) {
+		chip->ns_acc -= chip->srate;
+		ns++;
+	}
+	return ns;
 }
 
-#if PPSP_DEBUG
-static int ti=0;
-#endif
-static void ppsp_pointer_update(struct snd_ppsp *chip)
+static unsigned int ppsp_pointer_update(struct snd_ppsp *chip)
 {
-	struct snd_pcm_substream *substream;
-	size_t period_bytes, buffer_bytes;
-	int periods_elapsed;
+	unsigned int periods_elapsed, bits;
 	unsigned long flags;
 
 	/* update the playback position */
-	substream = chip->playback_substream;
-	if (!substream)
-		return;
-/*
- printk(KERN_INFO "PPSP: buffer_bytes mod period_bytes != 0 ? (%zi %zi %zi)\n",
-  chip->playback_ptr, period_bytes, buffer_bytes);
-*/
-	period_bytes = snd_pcm_lib_period_bytes(substream);
-	buffer_bytes = snd_pcm_lib_buffer_bytes(substream);
+	if (!chip->playback_substream)
+		return 0;
 
-	spin_lock_irqsave(&chip->substream_lock, flags);
-	chip->playback_ptr += PPSP_INDEX_INC() * chip->fmt_size * chip->chans;
-	periods_elapsed = chip->playback_ptr - chip->period_ptr;
-	if (periods_elapsed < 0) {
-#if PPSP_DEBUG
-		ti++;
-		if(debug && (ti%1000)==1)
-		printk(KERN_INFO "PPSP: pb_ptr(%zi) pe_ptr(%zi)"
-			", buffer_b(%zi) %% period_b(%zi) = %zi != 0 ?\n",
-			chip->playback_ptr, chip->period_ptr,
-			buffer_bytes, period_bytes, buffer_bytes % period_bytes
-		);
-#endif
-		periods_elapsed += buffer_bytes;
-	}
-	periods_elapsed /= period_bytes;
 	/* wrap the pointer _before_ calling snd_pcm_period_elapsed(),
 	 * or ALSA will BUG on us. */
-	chip->playback_ptr %= buffer_bytes;
-
-	if (periods_elapsed) {
-		chip->period_ptr += periods_elapsed * period_bytes;
-		chip->period_ptr %= buffer_bytes;
+	spin_lock_irqsave(&chip->substream_lock, flags);
+	/* a stop already cleared the link timestamp, leave it so */
+	if (atomic_read(&chip->timer_active)) {
+		chip->link_time = chip->emit_time;
+		chip->link_frames = chip->frames_played;
 	}
+	chip->frames_played += PPSP_INDEX_INC();
+	/* a 4-bit mono tick is half a byte, carry the rest */
+	bits = chip->bit_phase + chip->tick_bits;
+	chip->bit_phase = bits & 7;
+	periods_elapsed = ppsp_ptr_advance(&chip->playback_ptr,
+		&chip->period_ptr, bits >> 3,
+		chip->period_bytes, chip->buffer_bytes);
 	spin_unlock_irqrestore(&chip->substream_lock, flags);
 
 	if (periods_elapsed)
-		tasklet_schedule(&ppsp_pcm_tasklet);
+		queue_work(system_highpri_wq, &ppsp_pcm_work);
+	return periods_elapsed;
 }
 
 enum hrtimer_restart ppsp_do_timer(struct hrtimer *handle)
@@ -262,7 +355,9 @@ enum hrtimer_restart ppsp_do_timer(struct hrtimer *handle)
 	int pointer_update;
 	u64 ns;
 
-	if (!atomic_read(&chip->timer_active) || !chip->playback_substream)
+	if (!atomic_read(&chip->timer_active))
+		return HRTIMER_NORESTART;
+	if (!chip->playback_substream && !atomic_read(&chip->kpcm.on))
 		return HRTIMER_NORESTART;
 
 	pointer_update = 1;
@@ -274,29 +369,95 @@ enum hrtimer_restart ppsp_do_timer(struct hrtimer *handle)
 
 	if (pointer_update)
 		ppsp_pointer_update(chip);
+	/* a kernel stream playing alone stops when it runs dry */
+	if (!chip->playback_substream && ppsp_kpcm_drained(chip))
+		return HRTIMER_NORESTART;
 
-	hrtimer_forward(handle, hrtimer_get_expires(handle), ns_to_ktime(ns));
+	if (atomic_read(&chip->stimer_on))
+		ppsp_timer_tick(chip, PPSP_INDEX_INC());
+
+	if (chip->spin_max) {
+		ktime_t now = ktime_get();
+		u64 missed;
+
+		chip->deadline = ktime_add_ns(chip->deadline, ns);
+		/* a whole tick late: skip the missed ones, as hrtimer_forward() */
+		if (!ktime_before(now, chip->deadline)) {
+			missed = div_u64(ktime_to_ns(ktime_sub(now, chip->deadline)),
+					 ns) + 1;
+			chip->deadline = ktime_add_ns(chip->deadline, missed * ns);
+			chip->spin_late += missed;
+		}
+		/* arm early by the current margin, ppsp_spin() does the rest */
+		hrtimer_set_expires(handle,
+			ktime_sub_ns(chip->deadline, chip->spin_margin));
+	} else
+		hrtimer_forward(handle, hrtimer_get_expires(handle), ns_to_ktime(ns));
 
 	return HRTIMER_RESTART;
 }
 
-static int ppsp_start_playing(struct snd_ppsp *chip)
+/* step the port(s) to the given level, to avoid pops */
+static void ppsp_ramp(struct snd_ppsp *chip, u8 to)
+{
+	int i=chip->last_val, j=(chip->port2?chip->last_val2:to);
+
+	while(i!=to || j!=to) {
+		if(i!=to)
+			i+=(i<to?1:-1);
+		if(j!=to)
+			j+=(j<to?1:-1);
+		ppsp_out_p(chip, i, j);
+	}
+	chip->last_val=to;
+	chip->last_val2=to;
+}
+
+/*
+ * Hold the cpu out of deep c-states only while a stream runs, their
+ * exit latency is in the range of a sample period
+ */
+void ppsp_qos_init(struct snd_ppsp *chip)
+{
+	if (qos_us < 0)
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,7,0)
+	cpu_latency_qos_add_request(&chip->qos, PM_QOS_DEFAULT_VALUE);
+#else
+	pm_qos_add_request(&chip->qos, PM_QOS_CPU_DMA_LATENCY,
+			   PM_QOS_DEFAULT_VALUE);
+#endif
+}
+
+static void ppsp_qos_update(struct snd_ppsp *chip, s32 val)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,7,0)
+	if (cpu_latency_qos_request_active(&chip->qos))
+		cpu_latency_qos_update_request(&chip->qos, val);
+#else
+	if (pm_qos_request_active(&chip->qos))
+		pm_qos_update_request(&chip->qos, val);
+#endif
+}
+
+void ppsp_qos_exit(struct snd_ppsp *chip)
 {
-	int i=chip->last_val, j=(i<0x80?1:-1);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,7,0)
+	if (cpu_latency_qos_request_active(&chip->qos))
+		cpu_latency_qos_remove_request(&chip->qos);
+#else
+	if (pm_qos_request_active(&chip->qos))
+		pm_qos_remove_request(&chip->qos);
+#endif
+}
 
+static int ppsp_start_playing(struct snd_ppsp *chip)
+{
 #if PPSP_DEBUG
 	if(debug)
 		printk(KERN_INFO "PPSP: %s called\n", __FUNCTION__);
 #endif
 
-//printk(KERN_DEBUG "PPSP: start, i=%d j=%d\n", i, j);
-	while(i!=0x80) {
-		i+=j;
-		outb_p(i, chip->port);
-//printk(KERN_DEBUG "PPSP: start, i=%d j=%d\n", i, j);
-	}
-	chip->last_val=i;
-
 	if (atomic_read(&chip->timer_active)) {
 		printk(KERN_ERR "PPSP: Timer already active\n");
 		return -EIO;
@@ -309,6 +470,9 @@ static int ppsp_start_playing(struct snd_ppsp *chip)
 	raw_spin_unlock(&i8253_lock);
 #endif
 	atomic_set(&chip->timer_active, 1);
+	ppsp_qos_update(chip, qos_us);
+	/* the first tick goes right away */
+	chip->deadline = ktime_get();
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0)
 	hrtimer_start(&ppsp_chip.timer, ktime_set(0, 0), HRTIMER_MODE_REL);
@@ -318,36 +482,52 @@ static int ppsp_start_playing(struct snd_ppsp *chip)
 	return 0;
 }
 
-static void ppsp_stop_playing(struct snd_ppsp *chip)
+/*
+ * Pick up allow_vol_boost turned off through sysfs; with the timer
+ * stopped, so no tick sees the volume change under it
+ */
+static void ppsp_apply_params(struct snd_ppsp *chip)
+{
+	if (!allow_vol_boost && chip->volume > 30)
+		chip->volume = 30;
+}
+
+/*
+ * Run the timer for the in-kernel producer, with no pcm open; the pcm
+ * prepare sets all of this up again
+ */
+int ppsp_start_kernel(struct snd_ppsp *chip, unsigned int rate)
 {
-        int i=chip->last_val, j=(i>0?-1:1);
+	ppsp_apply_params(chip);
+	chip->srate = rate;
+	chip->half_rate = (chip->srate > hr_thr ? 1 : 0);
+	chip->NS = PPSP_CALC_NS(chip->ns_rem);
+	chip->ns_acc = 0;
+	memset(chip->ns_err, 0, sizeof(chip->ns_err));
+	ppsp_ramp(chip, 0x80);
+	return ppsp_start_playing(chip);
+}
 
+/*
+ * Only flips the state, the timer sees it and does not restart;
+ * the rest is done by ppsp_quiesce() in sleepable context
+ */
+static void ppsp_stop_playing(struct snd_ppsp *chip)
+{
+	unsigned long flags;
 #if PPSP_DEBUG
 	if(debug)
 		printk(KERN_INFO "PPSP: %s called\n", __FUNCTION__);
-#endif
-#if PPSP_DUMP
-	if(ppsp_dbgfp) {
-		filp_close(ppsp_dbgfp,0);
-		ppsp_dbgfp=NULL;
-		ppsp_dbgoff=0;
-	}
 #endif
 	if (!atomic_read(&chip->timer_active))
 		return;
 
 	atomic_set(&chip->timer_active, 0);
-#if 0
-	outb(0x00, chip->port);
-#else
-//printk(KERN_DEBUG "PPSP: stop, i=%d j=%d\n", i, j);
-	while(i!=0) {
-		i+=j;
-		outb_p(j, chip->port);
-//printk(KERN_DEBUG "PPSP: stop, i=%d j=%d\n", i, j);
-	}
-	chip->last_val=i;
-#endif
+	ppsp_qos_update(chip, PM_QOS_DEFAULT_VALUE);
+	/* nothing is played, so there is no link time to report */
+	spin_lock_irqsave(&chip->substream_lock, flags);
+	chip->link_time = ktime_set(0, 0);
+	spin_unlock_irqrestore(&chip->substream_lock, flags);
 
 #if PPSP_I8253
 	raw_spin_lock(&i8253_lock);
@@ -359,26 +539,65 @@ static void ppsp_stop_playing(struct snd_ppsp *chip)
 }
 
 /*
- * Force to stop and sync the stream
+ * Wait for the timer and the period work to finish
  */
-void ppsp_sync_stop(struct snd_ppsp *chip)
+static void ppsp_quiesce(struct snd_ppsp *chip)
 {
-	local_irq_disable();
 	ppsp_stop_playing(chip);
-	local_irq_enable();
 	hrtimer_cancel(&chip->timer);
-	tasklet_kill(&ppsp_pcm_tasklet);
+	cancel_work_sync(&ppsp_pcm_work);
+}
+
+/*
+ * Force to stop and sync the stream, and bring the port down
+ */
+void ppsp_sync_stop(struct snd_ppsp *chip)
+{
+	ppsp_quiesce(chip);
+	ppsp_ramp(chip, 0);
 }
 
+/*
+ * Bring the port(s) back after a system sleep; a suspended stream gets
+ * its midpoint back, so the resume trigger only has to re-arm the timer
+ */
+void ppsp_restore_port(struct snd_ppsp *chip)
+{
+	chip->last_val = 0;
+	chip->last_val2 = 0;
+	ppsp_out_p(chip, 0, 0);
+	if (chip->playback_substream)
+		ppsp_ramp(chip, 0x80);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+/*
+Called by the core at hw_params, hw_free, prepare and close, only after
+ the stream was stopped, and in sleepable context.
+*/
+static int snd_ppsp_playback_sync_stop(struct snd_pcm_substream *substream)
+{
+	struct snd_ppsp *chip = snd_pcm_substream_chip(substream);
+	ppsp_quiesce(chip);
+	return 0;
+}
+#endif
+
 static int snd_ppsp_playback_close(struct snd_pcm_substream *substream)
 {
 	struct snd_ppsp *chip = snd_pcm_substream_chip(substream);
+	unsigned long flags;
 #if PPSP_DEBUG
 	if(debug)
 		printk(KERN_INFO "PPSP: %s called\n", __FUNCTION__);
 #endif
 	ppsp_sync_stop(chip);
+	/* snd_ppsp_kqueue() looks at it from any context */
+	spin_lock_irqsave(&chip->substream_lock, flags);
 	chip->playback_substream = NULL;
+	spin_unlock_irqrestore(&chip->substream_lock, flags);
+	/* kernel samples left over play on their own */
+	ppsp_kpcm_kick(chip);
 	return 0;
 }
 
@@ -387,6 +606,7 @@ This is called when the hardware parameter (hw_params) is set up by the applicat
  that is, once when the buffer size, the period size, the format, etc. are defined for
  the pcm substream.
 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
 static int snd_ppsp_playback_hw_params(struct snd_pcm_substream *substream,
 				       struct snd_pcm_hw_params *hw_params)
 {
@@ -395,8 +615,8 @@ static int snd_ppsp_playback_hw_params(struct snd_pcm_substream *substream,
 #if PPSP_DEBUG
 	int i;
 #endif
-	ppsp_sync_stop(chip);
-	err = snd_pcm_lib_malloc_pages(substream,
+	ppsp_quiesce(chip);
+	err = snd_pcm_lib_alloc_vmalloc_buffer(substream,
 				      params_buffer_bytes(hw_params));
 #if PPSP_DEBUG
 	i=params_rate(hw_params);
@@ -407,6 +627,7 @@ static int snd_ppsp_playback_hw_params(struct snd_pcm_substream *substream,
 		return err;
 	return 0;
 }
+#endif
 
 static int snd_ppsp_playback_hw_free(struct snd_pcm_substream *substream)
 {
@@ -416,7 +637,11 @@ static int snd_ppsp_playback_hw_free(struct snd_pcm_substream *substream)
 		printk(KERN_INFO "PPSP: %s called\n", __FUNCTION__);
 #endif
 	ppsp_sync_stop(chip);
-	return snd_pcm_lib_free_pages(substream);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+	return snd_pcm_lib_free_vmalloc_buffer(substream);
+#else
+	return 0;
+#endif
 }
 
 /*
@@ -430,16 +655,55 @@ Note that this callback is now non-atomic. You can use schedule-related function
 static int snd_ppsp_playback_prepare(struct snd_pcm_substream *substream)
 {
 	struct snd_ppsp *chip = snd_pcm_substream_chip(substream);
-	ppsp_sync_stop(chip);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+	ppsp_quiesce(chip);
+#endif
+	ppsp_apply_params(chip);
 	chip->playback_ptr = 0;
 	chip->period_ptr = 0;
 	chip->fmt_size =
 		snd_pcm_format_physical_width(substream->runtime->format) >> 3;
 	chip->is_signed = snd_pcm_format_signed(substream->runtime->format);
 	chip->chans = substream->runtime->channels;
+	chip->frame_bits =
+		snd_pcm_format_physical_width(substream->runtime->format) * chip->chans;
+	chip->bit_phase = 0;
+	chip->is_adpcm = 0;
+	switch (substream->runtime->format) {
+	case SNDRV_PCM_FORMAT_U8:
+		chip->xlat = ppsp_xlat_u8;
+		break;
+	case SNDRV_PCM_FORMAT_MU_LAW:
+		chip->xlat = ppsp_xlat_ulaw;
+		break;
+	case SNDRV_PCM_FORMAT_A_LAW:
+		chip->xlat = ppsp_xlat_alaw;
+		break;
+	case SNDRV_PCM_FORMAT_IMA_ADPCM:
+		chip->is_adpcm = 1;
+		chip->xlat = NULL;
+		break;
+	default:
+		chip->xlat = NULL;
+	}
+	memset(chip->adpcm, 0, sizeof(chip->adpcm));
+	chip->adpcm_next = 0;
 	chip->srate = substream->runtime->rate;
 	chip->half_rate=(chip->srate > hr_thr ? 1 : 0);
-	chip->NS=PPSP_CALC_NS();
+	chip->NS=PPSP_CALC_NS(chip->ns_rem);
+	chip->ns_acc=0;
+	ppsp_kpcm_retime(chip);
+	chip->frame_bytes = chip->fmt_size * chip->chans;
+	chip->tick_bits = PPSP_INDEX_INC() * chip->frame_bits;
+	chip->period_bytes = snd_pcm_lib_period_bytes(substream);
+	chip->buffer_bytes = snd_pcm_lib_buffer_bytes(substream);
+	memset(chip->ns_err, 0, sizeof(chip->ns_err));
+	chip->spin_total_ns = 0;
+	chip->spin_ticks = 0;
+	chip->spin_late = 0;
+	chip->frames_played = 0;
+	chip->link_frames = 0;
+	chip->link_time = ktime_set(0, 0);
 // #if PPSP_DEBUG
 //	if(debug)
 	{
@@ -453,11 +717,8 @@ static int snd_ppsp_playback_prepare(struct snd_pcm_substream *substream)
 			substream->runtime->periods);
 	}
 // #endif
-	while(chip->last_val>0) {
-		outb_p(chip->last_val, chip->port);
-		chip->last_val>>=1;
-	}
-	outb_p(0, chip->port);
+	/* settle on the midpoint here, so the trigger has nothing to do */
+	ppsp_ramp(chip, 0x80);
 	return 0;
 }
 
@@ -473,6 +734,7 @@ static int snd_ppsp_trigger(struct snd_pcm_substream *substream, int cmd)
 #endif
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
+	/* playback_ptr is kept over suspend, so it goes on from there */
 	case SNDRV_PCM_TRIGGER_RESUME:
 		return ppsp_start_playing(chip);
 	case SNDRV_PCM_TRIGGER_STOP:
@@ -489,28 +751,92 @@ static snd_pcm_uframes_t snd_ppsp_playback_pointer(struct snd_pcm_substream
 						   *substream)
 {
 	struct snd_ppsp *chip = snd_pcm_substream_chip(substream);
+	unsigned long flags;
 	unsigned int pos;
-	spin_lock(&chip->substream_lock);
+	/* nonatomic, so irqs are not disabled here */
+	spin_lock_irqsave(&chip->substream_lock, flags);
 	pos = chip->playback_ptr;
-	spin_unlock(&chip->substream_lock);
+	spin_unlock_irqrestore(&chip->substream_lock, flags);
 	return bytes_to_frames(substream->runtime, pos);
 }
 
+/* the outb time on the clock the runtime timestamps with */
+static ktime_t ppsp_link_tstamp(struct snd_pcm_runtime *runtime, ktime_t t)
+{
+	switch (runtime->tstamp_type) {
+	case SNDRV_PCM_TSTAMP_TYPE_MONOTONIC:
+		return t;
+	case SNDRV_PCM_TSTAMP_TYPE_MONOTONIC_RAW:
+		/* the offset only moves by the ntp slew, ppm over one tick */
+		return ktime_add(t, ktime_sub(ktime_get_raw(), ktime_get()));
+	default:
+		return ktime_mono_to_real(t);
+	}
+}
+
+/*
+Link audio timestamp: the frame count of the last emitted sample and
+ the time of its outb, on the runtime's clock. Nothing is extrapolated,
+ so the audio and system time are a matched pair.
+*/
+static int snd_ppsp_get_time_info(struct snd_pcm_substream *substream,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+			struct timespec64 *system_ts, struct timespec64 *audio_ts,
+#else
+			struct timespec *system_ts, struct timespec *audio_ts,
+#endif
+			struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+			struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+	struct snd_ppsp *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	unsigned long flags;
+	ktime_t t;
+	u64 frames, ns;
+
+	spin_lock_irqsave(&chip->substream_lock, flags);
+	t = chip->link_time;
+	frames = chip->link_frames;
+	spin_unlock_irqrestore(&chip->substream_lock, flags);
+
+	if (audio_tstamp_config->type_requested != SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK
+	    || !ktime_to_ns(t)) {
+		/* the core fills in the default one */
+		audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+
+	t = ppsp_link_tstamp(runtime, t);
+	ns = mul_u64_u32_div(frames, NSEC_PER_SEC, runtime->rate);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+	*system_ts = ktime_to_timespec64(t);
+	*audio_ts = ns_to_timespec64(ns);
+#else
+	*system_ts = ktime_to_timespec(t);
+	*audio_ts = ns_to_timespec(ns);
+#endif
+	audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK;
+	audio_tstamp_report->accuracy_report = 1;
+	/* known to one tick */
+	audio_tstamp_report->accuracy = chip->NS;
+	return 0;
+}
+
 static const struct snd_pcm_hardware snd_ppsp_playback = {
 	.info = (SNDRV_PCM_INFO_INTERLEAVED |
-		 SNDRV_PCM_INFO_HALF_DUPLEX |
+		 SNDRV_PCM_INFO_HAS_LINK_ATIME |
+		 SNDRV_PCM_INFO_RESUME |
 		 SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID),
 	.formats = (SNDRV_PCM_FMTBIT_U8
 #if DMIX_WANTS_S16
 		    | SNDRV_PCM_FMTBIT_S16_LE
 #endif
+		    /* near the dac resolution anyway, and 2-4x smaller */
+		    | SNDRV_PCM_FMTBIT_MU_LAW | SNDRV_PCM_FMTBIT_A_LAW
+		    | SNDRV_PCM_FMTBIT_IMA_ADPCM
 	    ),
-	.rates =
-//		SNDRV_PCM_RATE_8000 |
-		SNDRV_PCM_RATE_11025 | SNDRV_PCM_RATE_16000
-		| SNDRV_PCM_RATE_22050
-		| SNDRV_PCM_RATE_32000 | SNDRV_PCM_RATE_44100 | SNDRV_PCM_RATE_48000
-	,
+	/* the tick is computed from the rate, so anything in range goes */
+	.rates = SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_8000_48000,
 	.rate_min = PPSP_MIN_RATE__1,
 	.rate_max = PPSP_MAX_RATE__1,
 	.channels_min = 1,
@@ -527,16 +853,34 @@ static int snd_ppsp_playback_open(struct snd_pcm_substream *substream)
 {
 	struct snd_ppsp *chip = snd_pcm_substream_chip(substream);
 	struct snd_pcm_runtime *runtime = substream->runtime;
+	unsigned long flags;
+	int err;
 #if PPSP_DEBUG
 	if(debug)
 		printk(KERN_INFO "PPSP: %s called\n", __FUNCTION__);
 #endif
+	runtime->hw = snd_ppsp_playback;
+	runtime->hw.rate_max = chip->rate_max;
+	/* the period accounting wraps period_ptr at the buffer end */
+	err = snd_pcm_hw_constraint_integer(runtime,
+					    SNDRV_PCM_HW_PARAM_PERIODS);
+	if (err < 0)
+		return err;
+	/* a half-rate tick eats two frames, it must not cross the end */
+	err = snd_pcm_hw_constraint_step(runtime, 0,
+					 SNDRV_PCM_HW_PARAM_PERIOD_SIZE, 2);
+	if (err < 0)
+		return err;
+	/* the pcm takes the timer from the in-kernel producer */
+	ppsp_kpcm_yield(chip);
 	if (atomic_read(&chip->timer_active)) {
 		printk(KERN_ERR "PPSP: still active!!\n");
+		ppsp_kpcm_kick(chip);
 		return -EBUSY;
 	}
-	runtime->hw = snd_ppsp_playback;
+	spin_lock_irqsave(&chip->substream_lock, flags);
 	chip->playback_substream = substream;
+	spin_unlock_irqrestore(&chip->substream_lock, flags);
 	return 0;
 }
 
@@ -544,33 +888,54 @@ static const struct snd_pcm_ops snd_ppsp_playback_ops = {
 	.open = snd_ppsp_playback_open,
 	.close = snd_ppsp_playback_close,
 	.ioctl = snd_pcm_lib_ioctl,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
 	.hw_params = snd_ppsp_playback_hw_params,
+#else
+	.sync_stop = snd_ppsp_playback_sync_stop,
+#endif
 	.hw_free = snd_ppsp_playback_hw_free,
 	.prepare = snd_ppsp_playback_prepare,
 	.trigger = snd_ppsp_trigger,
 	.pointer = snd_ppsp_playback_pointer,
+	.get_time_info = snd_ppsp_get_time_info,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+	.page = snd_pcm_lib_get_vmalloc_page,
+#endif
 };
 
 int snd_ppsp_new_pcm(struct snd_ppsp *chip)
 {
 	int err;
 
-	err = snd_pcm_new(chip->card, "ppspeaker", 0, 1, 0, &chip->pcm);
+	ppsp_codec_init();
+
+	err = snd_pcm_new(chip->card, "ppspeaker", 0, 1, 1, &chip->pcm);
 	if (err < 0)
 		return err;
 
 	snd_pcm_set_ops(chip->pcm, SNDRV_PCM_STREAM_PLAYBACK,
 			&snd_ppsp_playback_ops);
+	snd_pcm_set_ops(chip->pcm, SNDRV_PCM_STREAM_CAPTURE,
+			&snd_ppsp_capture_ops);
 
 	chip->pcm->private_data = chip;
-	chip->pcm->info_flags = SNDRV_PCM_INFO_HALF_DUPLEX;
+	chip->pcm->info_flags = 0;
+	/* trigger & co. may sleep, period_elapsed comes from a work */
+	chip->pcm->nonatomic = true;
 	strcpy(chip->pcm->name, "ppsp");
 
-	snd_pcm_lib_preallocate_pages_for_all(chip->pcm,
-					      SNDRV_DMA_TYPE_CONTINUOUS,
-					      snd_dma_continuous_data
-					      (GFP_KERNEL), PPSP_BUFFER_SIZE,
-					      PPSP_BUFFER_SIZE);
+	/*
+	 * The buffer is only touched by the cpu, so it needs no contiguous
+	 * pages; allocated at hw_params, freed at hw_free
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+	snd_pcm_set_managed_buffer_all(chip->pcm, SNDRV_DMA_TYPE_VMALLOC,
+				       NULL, 0, PPSP_BUFFER_SIZE);
+#endif
 
 	return 0;
 }
+
+#if IS_ENABLED(CONFIG_SND_PPSP_KUNIT_TEST)
+#include "ppsp_test.c"
+#endif
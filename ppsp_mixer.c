@@ -76,6 +76,36 @@ static int ppsp_volume_put(struct snd_kcontrol *kcontrol,
 	return changed;
 }
 
+static int ppsp_nshape_info(struct snd_kcontrol *kcontrol,
+			    struct snd_ctl_elem_info *uinfo)
+{
+	static const char * const texts[] = {
+		"Off", "1st Order", "2nd Order",
+	};
+	return snd_ctl_enum_info(uinfo, 1, ARRAY_SIZE(texts), texts);
+}
+static int ppsp_nshape_get(struct snd_kcontrol *kcontrol,
+			   struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_ppsp *chip = snd_kcontrol_chip(kcontrol);
+	ucontrol->value.enumerated.item[0] = chip->nshape;
+	return 0;
+}
+static int ppsp_nshape_put(struct snd_kcontrol *kcontrol,
+			   struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_ppsp *chip = snd_kcontrol_chip(kcontrol);
+	int changed = 0;
+	unsigned int nshape = ucontrol->value.enumerated.item[0];
+	if (nshape > PPSP_NSHAPE_MAX)
+		return -EINVAL;
+	if(chip->nshape!=nshape) {
+		changed = 1;
+		chip->nshape = nshape;
+	}
+	return changed;
+}
+
 static int ppsp_enable_info(struct snd_kcontrol *kcontrol,
 			    struct snd_ctl_elem_info *uinfo)
 {
@@ -194,6 +224,7 @@ static struct snd_kcontrol_new snd_ppsp_controls_pcm[] = {
 	PPSP_MIXER_CONTROL(enable, "Master Playback Switch"),
 	PPSP_MIXER_CONTROL(volume, "Master Playback Volume"),
 	PPSP_MIXER_CONTROL(toggle1, "Toggle1 Playback Volume"),
+	PPSP_MIXER_CONTROL(nshape, "Noise Shaping Playback Enum"),
 };
 
 static struct snd_kcontrol_new snd_ppsp_controls_spkr[] = {
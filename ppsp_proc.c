@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * PP-Speaker driver for Linux
+ *
+ * Proc interface.
+ * Copyright (C) 2022-2022  ariel/KotCzarny
+ */
+
+#include <sound/core.h>
+#include <sound/info.h>
+#include <linux/math64.h>
+#include "ppsp.h"
+
+static void snd_ppsp_proc_read(struct snd_info_entry *entry,
+			       struct snd_info_buffer *buffer)
+{
+	struct snd_ppsp *chip = entry->private_data;
+	struct ppsp_calib *cal = &chip->calib;
+
+	if (chip->dac_gpios) {
+		snd_iprintf(buffer, "backend\t\tgpio\n");
+		snd_iprintf(buffer, "gpio_write_ns\t%u\n", chip->gpio_write_ns);
+		snd_iprintf(buffer, "gpio_sleeps\t%d\n", chip->gpio_sleeps);
+	} else
+		snd_iprintf(buffer, "backend\t\tport\n");
+	snd_iprintf(buffer, "port\t\t0x%x\n", chip->port);
+	if (chip->port2)
+		snd_iprintf(buffer, "port2\t\t0x%x\n", chip->port2);
+	snd_iprintf(buffer, "hr_thr\t\t%d\n", hr_thr);
+	snd_iprintf(buffer, "rate_max\t%u\n", chip->rate_max);
+	snd_iprintf(buffer, "timer_div\t%u\n", chip->stimer_div);
+	snd_iprintf(buffer, "qos_us\t\t%d\n", qos_us);
+	snd_iprintf(buffer, "spin_max_ns\t%u\n", chip->spin_max);
+	if (chip->spin_max) {
+		snd_iprintf(buffer, "spin_margin_ns\t%u\n", chip->spin_margin);
+		snd_iprintf(buffer, "spin_jitter_ns\t%u\n", chip->spin_jit);
+		snd_iprintf(buffer, "spin_ticks\t%llu\n", chip->spin_ticks);
+		snd_iprintf(buffer, "spin_total_ns\t%llu\n", chip->spin_total_ns);
+		snd_iprintf(buffer, "spin_avg_ns\t%llu\n", chip->spin_ticks ?
+			div64_u64(chip->spin_total_ns, chip->spin_ticks) : 0);
+		snd_iprintf(buffer, "spin_late\t%llu\n", chip->spin_late);
+	}
+	snd_iprintf(buffer, "calibrated\t%d\n", cal->done);
+	if (!cal->done)
+		return;
+	snd_iprintf(buffer, "outb_ns\t\t%u\n", cal->outb_ns);
+	snd_iprintf(buffer, "callback_ns\t%u\n", cal->cb_ns);
+	snd_iprintf(buffer, "late_ns\t\t%u\n", cal->late_ns);
+	snd_iprintf(buffer, "jitter_ns\t%u\n", cal->jitter_ns);
+	snd_iprintf(buffer, "ticks\t\t%u\n", cal->ticks);
+}
+
+int snd_ppsp_new_proc(struct snd_ppsp *chip)
+{
+	struct snd_info_entry *entry;
+	int err;
+
+	err = snd_card_proc_new(chip->card, "ppsp", &entry);
+	if (err < 0)
+		return err;
+	snd_info_set_text_ops(entry, chip, snd_ppsp_proc_read);
+	return 0;
+}
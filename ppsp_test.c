@@ -0,0 +1,317 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * KUnit tests for the PP-Speaker tick
+ *
+ * This file is included at the end of ppsp_lib.c, so the real prepare,
+ * tick and pointer functions are driven on a stub chip and runtime.
+ * The port is set to 0x80, the POST port outb_p() already writes for
+ * its delay, so no parallel port is needed.
+ */
+
+#include <kunit/test.h>
+
+#define PPSP_TEST_PORT	0x80
+#define PPSP_TEST_GUARD	64
+#define PPSP_TEST_LAPS	3
+
+struct ppsp_test_geom {
+	snd_pcm_format_t format;
+	unsigned int chans;
+	unsigned int rate;
+	snd_pcm_uframes_t period;
+	unsigned int periods;
+};
+
+static const struct ppsp_test_geom ppsp_test_geoms[] = {
+	{ SNDRV_PCM_FORMAT_U8,     1,  8000,  2, 2 },
+	{ SNDRV_PCM_FORMAT_U8,     2,  8000,  6, 3 },
+	{ SNDRV_PCM_FORMAT_U8,     1, 48000,  2, 2 },
+	{ SNDRV_PCM_FORMAT_U8,     2, 48000, 32, 4 },
+	{ SNDRV_PCM_FORMAT_S16_LE, 1,  8000, 32, 4 },
+	{ SNDRV_PCM_FORMAT_S16_LE, 2,  8000,  2, 2 },
+	{ SNDRV_PCM_FORMAT_S16_LE, 1, 48000,  6, 3 },
+	{ SNDRV_PCM_FORMAT_S16_LE, 2, 48000,  2, 5 },
+	{ SNDRV_PCM_FORMAT_MU_LAW, 1,  8000,  6, 3 },
+	{ SNDRV_PCM_FORMAT_MU_LAW, 2, 48000,  2, 2 },
+	{ SNDRV_PCM_FORMAT_A_LAW,  1, 48000,  2, 4 },
+	{ SNDRV_PCM_FORMAT_A_LAW,  2,  8000, 32, 2 },
+};
+
+static const struct ppsp_test_geom ppsp_test_adpcm_geoms[] = {
+	{ SNDRV_PCM_FORMAT_IMA_ADPCM, 1,  8000,  2, 2 },
+	{ SNDRV_PCM_FORMAT_IMA_ADPCM, 1,  8000,  6, 3 },
+	{ SNDRV_PCM_FORMAT_IMA_ADPCM, 2,  8000,  2, 3 },
+	{ SNDRV_PCM_FORMAT_IMA_ADPCM, 1, 48000,  2, 4 },
+	{ SNDRV_PCM_FORMAT_IMA_ADPCM, 2, 48000, 32, 2 },
+};
+
+/* port level of the t-th tick; never 0, which marks the guard */
+static unsigned int ppsp_test_level(size_t t)
+{
+	return 0x10 + (t * 37) % 0xe0;
+}
+
+/* plain truncation of a s16 to the port value */
+static unsigned int ppsp_test_out(int x)
+{
+	return (u8)clamp(x >> 8, -128, 127) ^ 0x80;
+}
+
+/* store a sample for level, U8 and S16 requantize back to it */
+static void ppsp_test_put(struct snd_ppsp *chip, u8 *p, unsigned int level)
+{
+	u16 s = (level - 0x80) * 256;
+
+	if (chip->fmt_size == 1) {
+		p[0] = level;
+		return;
+	}
+	p[0] = s & 0xff;
+	p[1] = s >> 8;
+}
+
+/* the port value a tick of level samples gives */
+static unsigned int ppsp_test_level_out(struct snd_ppsp *chip,
+	unsigned int level)
+{
+	if (!chip->xlat || chip->xlat == ppsp_xlat_u8)
+		return level;
+	return ppsp_test_out(chip->xlat[level]);
+}
+
+/* fill frames [from, to) with the level of frame / inc */
+static void ppsp_test_fill(struct snd_ppsp *chip, u8 *area,
+	size_t from, size_t to, unsigned int inc, bool guard)
+{
+	size_t f;
+	unsigned int c;
+
+	for (f = from; f < to; f++)
+		for (c = 0; c < chip->chans; c++)
+			ppsp_test_put(chip,
+				area + (f * chip->chans + c) * chip->fmt_size,
+				guard ? 0 : ppsp_test_level(f / inc));
+}
+
+static struct snd_ppsp *ppsp_test_prepare(struct kunit *test,
+	const struct ppsp_test_geom *g)
+{
+	struct snd_pcm_substream *substream;
+	struct snd_pcm_runtime *runtime;
+	struct snd_ppsp *chip;
+	unsigned int inc;
+	size_t frames, n;
+	int saved_thr;
+
+	chip = kunit_kzalloc(test, sizeof(*chip), GFP_KERNEL);
+	substream = kunit_kzalloc(test, sizeof(*substream), GFP_KERNEL);
+	runtime = kunit_kzalloc(test, sizeof(*runtime), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, chip);
+	KUNIT_ASSERT_NOT_NULL(test, substream);
+	KUNIT_ASSERT_NOT_NULL(test, runtime);
+
+	runtime->format = g->format;
+	runtime->channels = g->chans;
+	runtime->rate = g->rate;
+	runtime->period_size = g->period;
+	runtime->periods = g->periods;
+	runtime->buffer_size = g->period * g->periods;
+	runtime->frame_bits = snd_pcm_format_physical_width(g->format) * g->chans;
+	runtime->dma_bytes = frames_to_bytes(runtime, runtime->buffer_size);
+	runtime->dma_area = kunit_kzalloc(test,
+		runtime->dma_bytes + PPSP_TEST_GUARD, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, runtime->dma_area);
+	substream->runtime = runtime;
+	substream->private_data = chip;
+
+	ppsp_codec_init();
+	spin_lock_init(&chip->substream_lock);
+	spin_lock_init(&chip->kpcm.lock);
+	hrtimer_init(&chip->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	chip->port = PPSP_TEST_PORT;
+	chip->enable = 1;
+	chip->volume = 30;
+	chip->nshape = PPSP_NSHAPE_OFF;
+	chip->playback_substream = substream;
+
+	/* half-rate above 24kHz, whatever calibration or the user set */
+	saved_thr = hr_thr;
+	hr_thr = 24000;
+	KUNIT_ASSERT_EQ(test, snd_ppsp_playback_prepare(substream), 0);
+	hr_thr = saved_thr;
+
+	KUNIT_ASSERT_EQ(test, chip->buffer_bytes, runtime->dma_bytes);
+	if (chip->is_adpcm) {
+		/* any nibbles do, the guard decodes from zeroes */
+		for (n = 0; n < runtime->dma_bytes; n++)
+			runtime->dma_area[n] = n * 73 + 11;
+		return chip;
+	}
+	inc = PPSP_INDEX_INC();
+	frames = runtime->buffer_size;
+	ppsp_test_fill(chip, runtime->dma_area, 0, frames, inc, false);
+	ppsp_test_fill(chip, runtime->dma_area, frames,
+		frames + PPSP_TEST_GUARD / (runtime->frame_bits / 8), inc, true);
+	return chip;
+}
+
+/*
+ * One tick: check the value written to the port, then the hw and
+ * period pointers, the bit phase and the period count against a
+ * model that never wraps.
+ */
+static void ppsp_test_tick(struct kunit *test, struct snd_ppsp *chip,
+	size_t k, size_t *bits, unsigned int want)
+{
+	size_t done = *bits / 8;
+
+	KUNIT_ASSERT_NE(test, ppsp_timer_update(chip), 0);
+	KUNIT_ASSERT_EQ_MSG(test, chip->last_val, want, "tick %zu", k);
+
+	*bits += chip->tick_bits;
+	KUNIT_ASSERT_EQ_MSG(test, ppsp_pointer_update(chip),
+		*bits / 8 / chip->period_bytes - done / chip->period_bytes,
+		"tick %zu", k);
+	done = *bits / 8;
+	KUNIT_ASSERT_EQ_MSG(test, chip->playback_ptr,
+		done % chip->buffer_bytes, "tick %zu", k);
+	KUNIT_ASSERT_EQ_MSG(test, chip->period_ptr,
+		done / chip->period_bytes * chip->period_bytes %
+		chip->buffer_bytes, "tick %zu", k);
+	KUNIT_ASSERT_EQ_MSG(test, chip->bit_phase, *bits % 8, "tick %zu", k);
+}
+
+/* a few buffer laps, want() gives the port value for a frame */
+static void ppsp_test_laps(struct kunit *test, struct snd_ppsp *chip,
+	unsigned int (*want)(struct snd_ppsp *chip, size_t frame))
+{
+	size_t ticks, frames, k, bits;
+
+	frames = chip->buffer_bytes * 8 / chip->frame_bits;
+	ticks = PPSP_TEST_LAPS * frames / PPSP_INDEX_INC();
+	for (k = 0, bits = 0; k < ticks; k++)
+		ppsp_test_tick(test, chip, k, &bits,
+			want(chip, bits / chip->frame_bits % frames));
+}
+
+static unsigned int ppsp_test_want_plain(struct snd_ppsp *chip, size_t frame)
+{
+	return ppsp_test_level_out(chip,
+		ppsp_test_level(frame / PPSP_INDEX_INC()));
+}
+
+static unsigned int ppsp_test_want_toggle1(struct snd_ppsp *chip, size_t frame)
+{
+	size_t frames = chip->buffer_bytes / chip->frame_bytes;
+
+	/* full-rate, so one frame is one tick */
+	return ppsp_test_level_out(chip,
+		ppsp_test_level((frame + frames * 2 + chip->toggle1) % frames));
+}
+
+static void ppsp_test_geometry(struct kunit *test)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(ppsp_test_geoms); i++) {
+		kunit_info(test, "geometry %u\n", i);
+		ppsp_test_laps(test, ppsp_test_prepare(test, &ppsp_test_geoms[i]),
+			ppsp_test_want_plain);
+	}
+}
+
+static void ppsp_test_toggle1(struct kunit *test)
+{
+	static const struct ppsp_test_geom geoms[] = {
+		{ SNDRV_PCM_FORMAT_U8,     1, 8000, 2, 2 },
+		{ SNDRV_PCM_FORMAT_S16_LE, 1, 8000, 6, 3 },
+		{ SNDRV_PCM_FORMAT_S16_LE, 2, 8000, 2, 2 },
+		{ SNDRV_PCM_FORMAT_MU_LAW, 2, 8000, 2, 3 },
+	};
+	static const int toggles[] = { -1, 1, 3, 8 };
+	struct snd_ppsp *chip;
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(geoms); i++)
+		for (j = 0; j < ARRAY_SIZE(toggles); j++) {
+			chip = ppsp_test_prepare(test, &geoms[i]);
+			chip->toggle1 = toggles[j];
+			ppsp_test_laps(test, chip, ppsp_test_want_toggle1);
+		}
+}
+
+/*
+ * A reference decode of the buffer, in play order; after the first lap
+ * toggle1 jumps the read, which restarts the decoder state
+ */
+static void ppsp_test_adpcm_laps(struct kunit *test, struct snd_ppsp *chip,
+	int toggle1)
+{
+	const u8 *area = chip->playback_substream->runtime->dma_area;
+	struct ppsp_adpcm ref[2] = {};
+	size_t nibbles, ticks, k, n, bits;
+	int i, ch, v, accl, accr;
+
+	nibbles = chip->buffer_bytes * 2;
+	ticks = PPSP_TEST_LAPS * nibbles / chip->chans / PPSP_INDEX_INC();
+	for (k = 0, n = 0, bits = 0; k < ticks; k++) {
+		if (toggle1 && k == ticks / PPSP_TEST_LAPS) {
+			chip->toggle1 = toggle1;
+			n = (n + nibbles * 2 + toggle1 * (long)chip->chans) % nibbles;
+			memset(ref, 0, sizeof(ref));
+		}
+		accl = accr = 0;
+		for (i = 0; i < PPSP_INDEX_INC(); i++) {
+			for (ch = 0; ch < chip->chans; ch++, n++) {
+				n %= nibbles;
+				v = ppsp_adpcm_decode(&ref[ch], (n & 1) ?
+					area[n / 2] & 0x0f : area[n / 2] >> 4);
+				if (ch)
+					accr += v;
+				else
+					accl += v;
+			}
+			if (chip->chans == 1)
+				accr += v;
+		}
+		accl >>= chip->half_rate;
+		accr >>= chip->half_rate;
+		ppsp_test_tick(test, chip, k, &bits,
+			ppsp_test_out((accl + accr) >> 1));
+	}
+}
+
+static void ppsp_test_adpcm(struct kunit *test)
+{
+	static const int toggles[] = { 0, -1, 3 };
+	struct ppsp_adpcm st = {};
+	unsigned int i, j;
+
+	/* step 7 at index 0: 7/8 + 7 + 7/2 + 7/4, then 8 steps up */
+	KUNIT_EXPECT_EQ(test, ppsp_adpcm_decode(&st, 7), 11);
+	KUNIT_EXPECT_EQ(test, st.index, 8);
+	KUNIT_EXPECT_EQ(test, ppsp_adpcm_decode(&st, 8), 9);
+	KUNIT_EXPECT_EQ(test, st.index, 7);
+
+	for (i = 0; i < ARRAY_SIZE(ppsp_test_adpcm_geoms); i++)
+		for (j = 0; j < ARRAY_SIZE(toggles); j++) {
+			kunit_info(test, "geometry %u toggle1 %d\n", i, toggles[j]);
+			ppsp_test_adpcm_laps(test,
+				ppsp_test_prepare(test, &ppsp_test_adpcm_geoms[i]),
+				toggles[j]);
+		}
+}
+
+static struct kunit_case ppsp_test_cases[] = {
+	KUNIT_CASE(ppsp_test_geometry),
+	KUNIT_CASE(ppsp_test_toggle1),
+	KUNIT_CASE(ppsp_test_adpcm),
+	{}
+};
+
+static struct kunit_suite ppsp_test_suite = {
+	.name = "snd-ppsp",
+	.test_cases = ppsp_test_cases,
+};
+
+kunit_test_suite(ppsp_test_suite);
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * PP-Speaker driver for Linux
+ *
+ * ALSA timer driven by the sample clock.
+ * Copyright (C) 2022-2022  ariel/KotCzarny
+ */
+
+#include <linux/math64.h>
+#include <sound/core.h>
+#include <sound/timer.h>
+#include "ppsp.h"
+
+/*
+ * One timer tick is timer_div frames of the running stream; it shares
+ * the hrtimer of the stream and is silent while nothing plays
+ */
+static unsigned long snd_ppsp_timer_resolution(struct snd_timer *timer)
+{
+	struct snd_ppsp *chip = snd_timer_chip(timer);
+
+	return div_u64(1000000000ULL * chip->stimer_div, chip->srate);
+}
+
+static int snd_ppsp_timer_start(struct snd_timer *timer)
+{
+	struct snd_ppsp *chip = snd_timer_chip(timer);
+
+	chip->stimer_frames = 0;
+	atomic_set(&chip->stimer_on, 1);
+	return 0;
+}
+
+static int snd_ppsp_timer_stop(struct snd_timer *timer)
+{
+	struct snd_ppsp *chip = snd_timer_chip(timer);
+
+	atomic_set(&chip->stimer_on, 0);
+	return 0;
+}
+
+static const struct snd_timer_hardware snd_ppsp_timer_hw = {
+	.flags = SNDRV_TIMER_HW_AUTO,
+	.resolution = 0,	/* follows the stream rate */
+	.ticks = 1,
+	.c_resolution = snd_ppsp_timer_resolution,
+	.start = snd_ppsp_timer_start,
+	.stop = snd_ppsp_timer_stop,
+};
+
+/* called from the hrtimer tick */
+void ppsp_timer_tick(struct snd_ppsp *chip, unsigned int frames)
+{
+	chip->stimer_frames += frames;
+	if (chip->stimer_frames < chip->stimer_div)
+		return;
+	chip->stimer_frames -= chip->stimer_div;
+	snd_timer_interrupt(chip->stimer, 1);
+}
+
+int snd_ppsp_new_timer(struct snd_ppsp *chip)
+{
+	struct snd_timer_id tid;
+	struct snd_timer *timer;
+	int err;
+
+	tid.dev_class = SNDRV_TIMER_CLASS_CARD;
+	tid.dev_sclass = SNDRV_TIMER_SCLASS_NONE;
+	tid.card = chip->card->number;
+	tid.device = 0;
+	tid.subdevice = 0;
+	err = snd_timer_new(chip->card, "ppsp", &tid, &timer);
+	if (err < 0)
+		return err;
+
+	strcpy(timer->name, "PP-Speaker sample clock");
+	timer->private_data = chip;
+	timer->hw = snd_ppsp_timer_hw;
+	chip->stimer = timer;
+	return 0;
+}
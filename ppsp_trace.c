@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * PP-Speaker driver for Linux
+ *
+ * Capture of the emitted samples through relay/debugfs.
+ * Copyright (C) 2022-2022  ariel/KotCzarny
+ */
+
+#include <linux/debugfs.h>
+#include <linux/relay.h>
+#include "ppsp.h"
+
+#if PPSP_TRACE
+
+/*
+ * /sys/kernel/debug/ppsp/enable	0/1, start/stop recording
+ * /sys/kernel/debug/ppsp/captureN	per-cpu relay buffers of
+ *					struct ppsp_trace_rec, read or mmap
+ */
+#define PPSP_TRACE_SUBBUF	(64*1024)
+#define PPSP_TRACE_NSUBBUF	16
+
+bool ppsp_trace_on;
+static struct dentry *ppsp_trace_dir;
+static struct rchan *ppsp_trace_chan;
+
+static struct dentry *ppsp_trace_create_buf_file(const char *filename,
+	struct dentry *parent, umode_t mode, struct rchan_buf *buf,
+	int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
+}
+
+static int ppsp_trace_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static struct rchan_callbacks ppsp_trace_cb = {
+	.create_buf_file = ppsp_trace_create_buf_file,
+	.remove_buf_file = ppsp_trace_remove_buf_file,
+};
+
+/*
+ * Called from the timer with irqs off, so the per-cpu buffer is ours;
+ * when it is full the record is dropped, timing is never disturbed
+ */
+void ppsp_trace_emit(struct snd_ppsp *chip, u8 val, u8 val2)
+{
+	struct ppsp_trace_rec rec;
+
+	rec.ts = ktime_to_ns(chip->emit_time);
+	rec.pos = chip->playback_ptr;
+	rec.val = val;
+	rec.val2 = val2;
+	rec.flags = (chip->half_rate ? PPSP_TRACE_HALF_RATE : 0)
+		| (chip->enable ? 0 : PPSP_TRACE_MUTED);
+	__relay_write(ppsp_trace_chan, &rec, sizeof(rec));
+}
+
+/* the capture is optional, the card works without it */
+void ppsp_trace_init(void)
+{
+	ppsp_trace_dir = debugfs_create_dir("ppsp", NULL);
+	if (IS_ERR_OR_NULL(ppsp_trace_dir)) {
+		ppsp_trace_dir = NULL;
+		return;
+	}
+	ppsp_trace_chan = relay_open("capture", ppsp_trace_dir,
+				     PPSP_TRACE_SUBBUF, PPSP_TRACE_NSUBBUF,
+				     &ppsp_trace_cb, NULL);
+	if (!ppsp_trace_chan) {
+		printk(KERN_WARNING "PPSP: cannot open the capture relay\n");
+		debugfs_remove_recursive(ppsp_trace_dir);
+		ppsp_trace_dir = NULL;
+		return;
+	}
+	debugfs_create_bool("enable", 0600, ppsp_trace_dir, &ppsp_trace_on);
+}
+
+void ppsp_trace_exit(void)
+{
+	ppsp_trace_on = false;
+	if (ppsp_trace_chan)
+		relay_close(ppsp_trace_chan);
+	debugfs_remove_recursive(ppsp_trace_dir);
+	ppsp_trace_chan = NULL;
+	ppsp_trace_dir = NULL;
+}
+
+#endif